@@ -7,18 +7,77 @@
 #pragma once
 
 #include <nori/mesh.h>
-#include <nori/octree.h>
-#include <nori/emAccel.h>
 
 NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief A batch of rays that is traced using a single query
+ *
+ * Batches are traced as SIMD packets by the acceleration data structure.
+ * Rays that start close to each other and point into similar directions
+ * (e.g. primary rays of an image block) should set \ref coherent, which
+ * enables traversal optimizations for coherent packets.
+ */
+struct RayBatch {
+    std::vector<Ray3f> rays;
+    bool coherent = false;
+
+    /// Remove all rays from the batch
+    void clear() { rays.clear(); }
+
+    /// Append a ray to the batch
+    void add(const Ray3f &ray) { rays.push_back(ray); }
+
+    /// Return the number of rays in the batch
+    size_t size() const { return rays.size(); }
+};
+
+/// Per-ray results of a \ref RayBatch query
+struct HitBatch {
+    /// Detailed intersection records (only filled by closest-hit queries)
+    std::vector<Intersection> its;
+    /// Nonzero if the corresponding ray found an intersection
+    std::vector<uint8_t> hit;
+
+    /// Resize the batch to hold \c n results
+    void resize(size_t n) { its.resize(n); hit.resize(n); }
+
+    /// Return the number of results in the batch
+    size_t size() const { return hit.size(); }
+};
+
+/**
+ * \brief Triangles that an occlusion query should pass through
+ *
+ * Shadow rays towards a point on an emitter must neither be blocked by the
+ * emitter itself nor by the triangle that they start from.
+ */
+struct OcclusionFilter {
+    const Mesh *ignoreMesh = nullptr;  ///< Ignore all triangles of this mesh
+    const Mesh *selfMesh = nullptr;    ///< Ignore triangle \ref selfPrim of this mesh
+    uint32_t selfPrim = 0;
+
+    /// Should a hit of triangle \c prim of \c mesh be ignored?
+    bool ignores(const Mesh *mesh, uint32_t prim) const {
+        return mesh == ignoreMesh || (mesh == selfMesh && prim == selfPrim);
+    }
+};
+
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * This is the base class of all acceleration data structures. It keeps
+ * track of the registered meshes and turns the raw hits found by a
+ * subclass into detailed intersection records. The implementation can
+ * be selected and configured using an <tt>&lt;accel&gt;</tt> tag in the
+ * scene description; by default, Embree is used (see \ref EmAccel).
+ * \ref BVH is a portable alternative (<tt>&lt;accel type="bvh"/&gt;</tt>).
  */
-class Accel {
+class Accel : public NoriObject {
 public:
+    /// Release the acceleration data structure
+    virtual ~Accel() { }
+
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
@@ -27,8 +86,8 @@ public:
      */
     void addMesh(Mesh *mesh);
 
-    /// Build the acceleration data structure (currently a no-op)
-    void build();
+    /// Build the acceleration data structure
+    virtual void build() = 0;
 
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
@@ -50,16 +109,82 @@ public:
      *    find out whether the ray is blocked or not without returning detailed
      *    intersection information.
      *
+     * \param resolve
+     *    If \c false, only the hit itself is recorded and the surface
+     *    properties of \c its are left uninitialized (see
+     *    \ref Intersection::resolve())
+     *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay,
+                      bool resolve = true) const;
 
-private:
+    /**
+     * \brief Intersect a batch of rays against all triangles stored in the
+     * scene and return detailed intersection information for each of them
+     *
+     * \param rays
+     *    The rays to be traced
+     *
+     * \param hits
+     *    Will be resized to the number of rays and receives a hit flag and
+     *    an intersection record per ray
+     */
+    void rayIntersect(const RayBatch &rays, HitBatch &hits) const;
+
+    /**
+     * \brief Determine for each ray of a batch whether it is blocked or not
+     *
+     * This is the batched counterpart of a shadow ray query: only the
+     * \c hit flags of \c hits are filled.
+     */
+    void rayOccluded(const RayBatch &rays, HitBatch &hits) const;
+
+    /**
+     * \brief Determine whether a ray is blocked by any triangle that is
+     * not excluded by \c filter
+     *
+     * Unlike a closest-hit query, this stops at the first relevant hit.
+     */
+    bool rayOccluded(const Ray3f &ray, const OcclusionFilter &filter) const {
+        return traceOccluded(ray, filter);
+    }
+
+    /**
+     * \brief Return the type of object (i.e. Mesh/Accel/etc.)
+     * provided by this instance
+     * */
+    EClassType getClassType() const { return EAccel; }
+
+protected:
+    /**
+     * \brief Find the closest hit (or any hit for shadow rays) along a ray
+     *
+     * Implementations fill in \c its.t, \c its.mesh and the barycentric
+     * coordinates of the hit in \c its.bary, shorten \c ray.maxt, and store
+     * the index of the hit triangle in \c f.
+     */
+    virtual bool traceRay(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &f) const = 0;
+
+    /**
+     * \brief Batched version of \ref traceRay()
+     *
+     * The triangle index of each hit is stored in its \c primIdx field.
+     * The default implementation traces the rays one at a time.
+     */
+    virtual void traceRays(const RayBatch &rays, HitBatch &hits, bool shadowRay) const;
+
+    /**
+     * \brief Implementation of filtered occlusion queries
+     *
+     * The default implementation steps through the hits along the ray
+     * using \ref traceRay() until it finds one that is not ignored.
+     */
+    virtual bool traceOccluded(const Ray3f &ray, const OcclusionFilter &filter) const;
+
+protected:
     std::vector<Mesh*> m_meshes;
     BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
-    OctreeNode   *m_root = nullptr;
-    EmAccel      *m_emAccel = nullptr;
-
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,252 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <limits>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Discrete probability distribution based on an alias table
+ *
+ * This is a drop-in replacement for \ref DiscretePDF with the same
+ * interface. Instead of searching a CDF in O(log n), \ref normalize()
+ * builds a table using Vose's variant of Walker's alias method, after
+ * which every sample costs O(1): one lookup picks a bin uniformly,
+ * and a second comparison chooses between the bin's own entry and its
+ * alias. Prefer it for large distributions that are sampled often,
+ * e.g. over the triangles of an emitter.
+ *
+ * Note that unlike \ref DiscretePDF, samples are only available after
+ * \ref normalize() has been called.
+ *
+ * \ingroup libcore
+ */
+struct AliasPDF {
+public:
+    /// Allocate memory for a distribution with the given number of entries
+    explicit AliasPDF(size_t nEntries = 0) {
+        reserve(nEntries);
+        clear();
+    }
+
+    /// Clear all entries
+    void clear() {
+        m_pdf.clear();
+        m_table.clear();
+        m_sum = m_normalization = 0.0f;
+        m_normalized = false;
+    }
+
+    /// Reserve memory for a certain number of entries
+    void reserve(size_t nEntries) {
+        m_pdf.reserve(nEntries);
+        m_table.reserve(nEntries);
+    }
+
+    /// Append an entry with the specified discrete probability
+    void append(float pdfValue) {
+        m_pdf.push_back(pdfValue);
+    }
+
+    /// Return the number of entries so far
+    size_t size() const {
+        return m_pdf.size();
+    }
+
+    /// Access an entry by its index
+    float operator[](size_t entry) const {
+        return m_pdf[entry];
+    }
+
+    /// Have the probability densities been normalized?
+    bool isNormalized() const {
+        return m_normalized;
+    }
+
+    /**
+     * \brief Return the original (unnormalized) sum of all PDF entries
+     *
+     * This assumes that \ref normalize() has previously been called
+     */
+    float getSum() const {
+        return m_sum;
+    }
+
+    /**
+     * \brief Return the normalization factor (i.e. the inverse of \ref getSum())
+     *
+     * This assumes that \ref normalize() has previously been called
+     */
+    float getNormalization() const {
+        return m_normalization;
+    }
+
+    /**
+     * \brief Normalize the distribution and build the alias table
+     *
+     * \return Sum of the (previously unnormalized) entries
+     */
+    float normalize() {
+        double sum = 0.0;
+        for (float value : m_pdf)
+            sum += value;
+        m_sum = (float) sum;
+        if (m_sum <= 0) {
+            m_normalization = 0.0f;
+            return m_sum;
+        }
+        m_normalization = 1.0f / m_sum;
+
+        /* Scale the entries so that the average bin holds exactly 1 */
+        size_t n = m_pdf.size();
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        m_table.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = m_pdf[i] * (double) n / sum;
+            m_pdf[i] = (float) (m_pdf[i] / sum);
+            if (scaled[i] < 1.0)
+                small.push_back((uint32_t) i);
+            else
+                large.push_back((uint32_t) i);
+        }
+
+        /* Fill each underfull bin with the remainder of an overfull one */
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            m_table[s].prob = (float) scaled[s];
+            m_table[s].alias = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        /* Whatever is left is full up to round-off */
+        for (uint32_t i : small)
+            m_table[i] = Bin { 1.0f, i };
+        for (uint32_t i : large)
+            m_table[i] = Bin { 1.0f, i };
+
+        m_normalized = true;
+        return m_sum;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sample(float sampleValue) const {
+        float remapped;
+        return sampleBin(sampleValue, remapped);
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sample(float sampleValue, float &pdf) const {
+        size_t index = sample(sampleValue);
+        pdf = operator[](index);
+        return index;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     *
+     * \param[in, out] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleReuse(float &sampleValue) const {
+        return sampleBin(sampleValue, sampleValue);
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample.
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     *
+     * \param[in,out]
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleReuse(float &sampleValue, float &pdf) const {
+        size_t index = sampleReuse(sampleValue);
+        pdf = operator[](index);
+        return index;
+    }
+
+    /**
+     * \brief Turn the underlying distribution into a
+     * human-readable string format
+     */
+    std::string toString() const {
+        std::string result = tfm::format("AliasPDF[sum=%f, "
+            "normalized=%f, pdf = {", m_sum, m_normalized);
+
+        for (size_t i=0; i<m_pdf.size(); ++i) {
+            result += std::to_string(m_pdf[i]);
+            if (i != m_pdf.size()-1)
+                result += ", ";
+        }
+        return result + "}]";
+    }
+private:
+    /// Entry of the alias table
+    struct Bin {
+        float prob;      ///< Probability of keeping the bin's own entry
+        uint32_t alias;  ///< Entry chosen otherwise
+    };
+
+    /**
+     * \brief Choose a bin and then either its own entry or its alias
+     *
+     * The position within the part of the bin that led to the returned
+     * index is rescaled to [0,1) and stored in \c remapped
+     */
+    size_t sampleBin(float sampleValue, float &remapped) const {
+        const float oneMinusEpsilon = 1.0f - std::numeric_limits<float>::epsilon() / 2;
+        float scaled = sampleValue * m_table.size();
+        size_t index = std::min((size_t) scaled, m_table.size() - 1);
+        float offset = std::min(scaled - (float) index, oneMinusEpsilon);
+        const Bin &bin = m_table[index];
+        if (offset < bin.prob) {
+            remapped = std::min(offset / bin.prob, oneMinusEpsilon);
+            return index;
+        }
+        remapped = std::min((offset - bin.prob) / (1.0f - bin.prob), oneMinusEpsilon);
+        return bin.alias;
+    }
+
+    std::vector<float> m_pdf;
+    std::vector<Bin> m_table;
+    float m_sum, m_normalization;
+    bool m_normalized;
+};
+
+NORI_NAMESPACE_END
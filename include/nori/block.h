@@ -13,8 +13,12 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <atomic>
+#include <iosfwd>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
+#define NORI_BLOCK_LOCK_ROWS 8 /* Number of rows protected by each lock of an image block */
+#define NORI_BLOCK_MIN_SIZE 8 /* Blocks are not split any further than this */
 
 NORI_NAMESPACE_BEGIN
 
@@ -31,9 +35,15 @@ NORI_NAMESPACE_BEGIN
  * this region. For that reason, this class also stores information about
  * a small border region around the rectangle, whose size depends on the
  * properties of the reconstruction filter.
+ *
+ * Concurrent merges (\ref put(ImageBlock &)) and reads (\ref snapshot())
+ * are synchronized using one mutex per stripe of \c NORI_BLOCK_LOCK_ROWS
+ * rows, so that blocks covering different rows never wait for each other.
  */
 class ImageBlock : public Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> {
 public:
+    typedef Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Base;
+
     /**
      * Create a new image block of the specified maximum size
      * \param size
@@ -74,7 +84,29 @@ public:
     void fromBitmap(const Bitmap &bitmap);
 
     /// Clear all contents
-    void clear() { setConstant(Color4f()); }
+    void clear() { setConstant(Color4f()); m_moments.setZero(); }
+
+    /**
+     * \brief Enable per-pixel sample statistics
+     *
+     * When enabled, every call to \ref put(const Point2f &, const Color3f &)
+     * also records the luminance of the sample (and its square) in the pixel
+     * that contains it, which allows estimating the error of each pixel
+     * (see \ref getRelativeError()). The statistics are merged along with
+     * the pixel values.
+     */
+    void setMomentsEnabled(bool enabled);
+
+    /// Are per-pixel sample statistics being recorded?
+    bool hasMoments() const { return m_moments.size() > 0; }
+
+    /**
+     * \brief Return the estimated relative standard error of the mean
+     * luminance of a pixel (given in coordinates relative to the block)
+     *
+     * Returns infinity for pixels with fewer than two samples.
+     */
+    float getRelativeError(const Point2i &pixel) const;
 
     /// Record a sample with the given position and radiance value
     void put(const Point2f &pos, const Color3f &value);
@@ -82,16 +114,41 @@ public:
     /**
      * \brief Merge another image block into this one
      *
-     * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * During the merge operation, this function locks the
+     * row stripes of the destination block that it modifies.
      */
     void put(ImageBlock &b);
 
-    /// Lock the image block (using an internal mutex)
-    inline void lock() const { m_mutex.lock(); }
-    
-    /// Unlock the image block
-    inline void unlock() const { m_mutex.unlock(); }
+    /**
+     * \brief Copy the contents (including the border) into \c target
+     *
+     * The rows are copied one lock stripe at a time, so that concurrent
+     * merges are only held up briefly. This is used by the GUI.
+     */
+    void snapshot(Base &target) const;
+
+    /**
+     * \brief Write the unnormalized contents and statistics to a binary stream
+     *
+     * Used for render checkpoints, see \ref load()
+     */
+    void save(std::ostream &os) const;
+
+    /// Restore contents written by \ref save() into a block of the same size
+    void load(std::istream &is);
+
+    /**
+     * \brief Save the unnormalized contents (without the border) as an
+     * OpenEXR file with the channels R, G, B and W (filter weight)
+     *
+     * Partial renders of the same image (e.g. different tiles or passes
+     * rendered by separate processes) can be combined by adding them up
+     * using \ref accumulateEXR(). The extension ".exr" is appended.
+     */
+    void saveEXR(const std::string &filename) const;
+
+    /// Add a partial OpenEXR file written by \ref saveEXR() to the block
+    void accumulateEXR(const std::string &filename);
 
     /// Return a human-readable string summary
     std::string toString() const;
@@ -104,51 +161,134 @@ protected:
     float *m_weightsX = nullptr;
     float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
-    mutable tbb::mutex m_mutex;
+    /// Sample count, luminance sum and sum of squared luminances per pixel
+    Eigen::Array<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> m_moments;
+    /// One mutex per stripe of NORI_BLOCK_LOCK_ROWS rows
+    mutable std::vector<tbb::mutex> m_rowLocks;
 };
 
 /**
- * \brief Spiraling block generator
+ * \brief Block generator
  *
  * This class can be used to chop up an image into many small
- * rectangular blocks suitable for parallel rendering. The blocks
- * are ordered in spiraling pattern so that the center is
- * rendered first.
+ * rectangular blocks suitable for parallel rendering. The order of
+ * the blocks is computed once at construction time; by default, the
+ * blocks are ordered in spiraling pattern so that the center is
+ * rendered first. Blocks are then handed out using an atomic counter,
+ * and \ref reset() starts over for the next pass of a progressive render.
+ *
+ * Between passes, \ref schedule() can reorder the blocks according to the
+ * render times recorded using \ref setCost(), so that the most expensive
+ * blocks are started first and no single block dominates the end of a pass.
  */
 class BlockGenerator {
 public:
+    /// Order in which blocks are handed out
+    enum EOrder {
+        ESpiral = 0, ///< Spiral starting at the center of the image
+        EHilbert,    ///< Hilbert curve (neighboring blocks are rendered together)
+        EScanline    ///< Row by row, starting at the top
+    };
+
     /**
      * \brief Create a block generator with
      * \param size
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param order
+     *      Order in which the blocks are returned by \ref next()
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
+    BlockGenerator(const Vector2i &size, int blockSize, EOrder order = ESpiral);
     
     /**
      * \brief Return the next block to be rendered
      *
-     * This function is thread-safe
+     * This function is thread-safe (and lock-free)
+     *
+     * \param index
+     *      If specified, receives the index of the block, which
+     *      identifies it in calls to \ref setCost()
      *
      * \return \c false if there were no more blocks
      */
-    bool next(ImageBlock &block);
+    bool next(ImageBlock &block, int *index = nullptr);
+
+    /// Hand out all blocks again (not thread-safe)
+    void reset() { m_next = 0; }
+
+    /**
+     * \brief Only keep the blocks <tt>[first, last)</tt> of the initial order
+     *
+     * This allows several processes to render disjoint tiles of the same
+     * image. \c last is clamped to the block count. Must be called before
+     * \ref schedule(), which changes the block indices.
+     */
+    void setRange(int first, int last);
+
+    /**
+     * \brief Configure \c block to cover the block with the given index
+     *
+     * Unlike \ref next(), this does not advance the generator. It is used
+     * when several threads render (different samples of) the same block.
+     */
+    void getBlock(int index, ImageBlock &block) const;
+
+    /**
+     * \brief Record how long it took to render a block (in ms)
+     *
+     * This function is thread-safe as long as each block is
+     * only reported by one thread
+     */
+    void setCost(int index, float cost) { m_costs[index] = cost; }
+
+    /**
+     * \brief Prepare the next pass based on the recorded costs
+     *
+     * Blocks whose cost exceeds half of the expected work per worker are
+     * split into quadrants (down to \c NORI_BLOCK_MIN_SIZE pixels), and
+     * the blocks are sorted by decreasing cost. This function also calls
+     * \ref reset() and is not thread-safe.
+     *
+     * \param workerCount
+     *      Number of threads that render the blocks
+     */
+    void schedule(int workerCount);
+
+    /// Write the block layout and costs to a binary stream
+    void save(std::ostream &os) const;
+
+    /// Restore a layout written by \ref save() (also calls \ref reset())
+    void load(std::istream &is);
 
     /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    int getBlockCount() const { return (int) m_blocks.size(); }
+
+    /// Parse the name of a block order ("spiral", "hilbert" or "scanline")
+    static EOrder orderFromString(const std::string &name);
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
+    /// Pixel region of a block
+    struct Block {
+        Point2i offset;
+        Vector2i size;
+    };
+
+    /// Append the blocks of the respective ordering to \ref m_blocks
+    void generateSpiral();
+    void generateHilbert();
+    void generateScanline();
+
+    /// Append a block in units of \ref m_blockSize
+    void addBlock(const Point2i &block);
+
+    std::vector<Block> m_blocks;     ///< Blocks in the order they are handed out
+    std::vector<float> m_costs;      ///< Render time of each block in the last pass
+    std::atomic<int> m_next{0};      ///< Index of the next block in \ref m_blocks
     Vector2i m_numBlocks;
     Vector2i m_size;
     int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
 };
 
 NORI_NAMESPACE_END
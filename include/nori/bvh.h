@@ -0,0 +1,89 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy built using the surface area heuristic
+ *
+ * This is a self-contained alternative to \ref EmAccel. The hierarchy is
+ * built in parallel using binned SAH splits and stored as a flat array of
+ * 32-byte nodes in depth-first order, so that the first child of a node
+ * directly follows it in memory. Traversal uses a small fixed-size stack
+ * and visits the child that is closer along the ray direction first.
+ *
+ * The following properties can be specified using
+ * <tt>&lt;accel type="bvh"&gt;</tt>:
+ *
+ * - \c maxLeafSize: maximum number of triangles per leaf (default: 4)
+ * - \c binCount: number of SAH bins per split (default: 16)
+ */
+class BVH : public Accel {
+public:
+    BVH(const PropertyList &propList);
+
+    /// Build the hierarchy over all registered meshes
+    void build();
+
+    /// Return the time taken by the last call to \ref build() (in ms)
+    double getBuildTime() const { return m_buildTime; }
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+protected:
+    bool traceRay(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &f) const;
+    bool traceOccluded(const Ray3f &ray, const OcclusionFilter &filter) const;
+
+private:
+    /// Compact node representation (two nodes per cache line)
+    struct alignas(32) BVHNode {
+        BoundingBox3f bbox;   ///< Bounds of all triangles below this node
+        uint32_t offset;      ///< Leaf: first primitive, inner node: second child
+        uint16_t count;       ///< Number of primitives (zero for inner nodes)
+        uint8_t axis;         ///< Split axis of inner nodes
+        uint8_t unused;
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    /// Reference to a triangle of one of the registered meshes
+    struct Primitive {
+        uint32_t mesh;
+        uint32_t face;
+    };
+
+    struct BuildPrimitive;
+    struct BuildNode;
+
+    /// Recursively split the given range of primitives
+    BuildNode *buildRecursive(BuildPrimitive *prims, uint32_t start,
+                              uint32_t end, uint32_t depth) const;
+
+    /**
+     * \brief Store a subtree in depth-first order and return the index of its root
+     *
+     * \c maxDepth is raised to the depth of the deepest leaf, which bounds
+     * the number of entries on the traversal stack
+     */
+    uint32_t flatten(const BuildNode *node, uint32_t depth, uint32_t &maxDepth);
+
+    /// Shared traversal loop, which skips the triangles excluded by \c filter
+    bool traverse(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &f,
+                  const OcclusionFilter *filter) const;
+
+    std::vector<BVHNode> m_nodes;       ///< Flattened hierarchy
+    std::vector<Primitive> m_prims;     ///< Triangles in leaf order
+    uint32_t m_maxLeafSize;
+    uint32_t m_binCount;
+    double m_buildTime = 0;
+};
+
+NORI_NAMESPACE_END
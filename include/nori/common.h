@@ -131,6 +131,10 @@ using std::endl;
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
 
+/// Views onto matrix storage that is owned elsewhere (e.g. padded geometry buffers)
+typedef Eigen::Map<MatrixXf, Eigen::Aligned16> MatrixXfMap;
+typedef Eigen::Map<MatrixXu, Eigen::Aligned16> MatrixXuMap;
+
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
 public:
@@ -175,6 +179,9 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/// Atomically move \c source to \c target, replacing \c target if it exists
+extern bool replaceFile(const std::string &source, const std::string &target);
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
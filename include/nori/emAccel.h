@@ -1,8 +1,8 @@
 ﻿#pragma once
 
-#include <nori/mesh.h>
-#include <nori/octree.h>
+#include <nori/accel.h>
 #include <embree4/rtcore.h>
+#include <map>
 
 
 NORI_NAMESPACE_BEGIN
@@ -12,16 +12,66 @@ NORI_NAMESPACE_BEGIN
 //	printf("error %d: %s\n", error, str);
 //}
 
-struct EmAccel {
+// embree acceleration structure, this is the default <accel type="embree">
+// supported properties:
+//   buildQuality  "low", "medium" (default) or "high"
+//   compact       use RTC_SCENE_FLAG_COMPACT (less memory, slower traversal)
+//   robust        use RTC_SCENE_FLAG_ROBUST (watertight, slower traversal)
+//   twoLevel      build a separate BVH per mesh (in parallel) and join them with a top level
+//                 scene of instances. faster builds for scenes with many meshes, slower traversal
+//   threads, isa, hugepages, config   device configuration, see rtcNewDevice
+//                 (threads defaults to the size of the shared thread pool, see threads.h)
+class EmAccel : public Accel {
 private:
 	
 	void InitializeDevice();
 	void InitializeScene();
+	void ReleaseScene();
+	// empty scene with the configured build quality and flags
+	RTCScene NewScene() const;
+	// triangle geometry that shares the buffers of the mesh
+	RTCGeometry NewTriangleGeometry(const Mesh* mesh) const;
+
+	// the device is shared by all EmAccel instances with the same configuration, the scene belongs to this one
+	RTCDevice m_device = nullptr;
+	RTCScene m_scene = nullptr;
+	// one bottom level scene per geometry that is referenced by instances (or per mesh in two level mode)
+	std::map<const MeshData*, RTCScene> m_prototypes;
+
+	// options from the scene description
+	std::string m_deviceConfig;
+	RTCBuildQuality m_buildQuality = RTC_BUILD_QUALITY_MEDIUM;
+	RTCSceneFlags m_sceneFlags = RTC_SCENE_FLAG_NONE;
+	bool m_twoLevel = false;
+
+	// statistics of the last build
+	double m_buildTime = 0;
+	size_t m_memoryUsage = 0;
+
+protected:
+	bool traceRay(Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& idx) const;
+	// trace a batch of rays as packets, the triangle index of each hit is stored in its.primIdx
+	void traceRays(const RayBatch& rays, HitBatch& hits, bool shadowRay) const;
+	// rtcOccluded1 with a filter function that skips the ignored triangles
+	bool traceOccluded(const Ray3f& ray, const OcclusionFilter& filter) const;
 
 public:
-	std::vector<Mesh*> m_meshes;
-	EmAccel(std::vector<Mesh*> meshes);
-	bool RayIntersect(Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& idx);
+	EmAccel(const PropertyList& props);
+	// releases the scene, and the shared device once the last EmAccel using it is gone
+	~EmAccel();
+	EmAccel(const EmAccel&) = delete;
+	EmAccel& operator=(const EmAccel&) = delete;
+
+	void build();
+
+	// build time in milliseconds and memory allocated by embree during the last build
+	double getBuildTime() const { return m_buildTime; }
+	size_t getMemoryUsage() const { return m_memoryUsage; }
+
+	std::string toString() const;
+
+	// width of the packets used by the batched query
+	static const int PacketSize = 8;
 };
 
 NORI_NAMESPACE_END
\ No newline at end of file
@@ -6,7 +6,7 @@
 
 #pragma once
 
-#include <nori/common.h>
+#include <nori/block.h>
 #include <nanogui/screen.h>
 
 NORI_NAMESPACE_BEGIN
@@ -17,6 +17,7 @@ public:
     void draw_contents() override;
 private:
     const ImageBlock &m_block;
+    ImageBlock::Base m_pixels; ///< Copy of the block that is uploaded to the GPU
     nanogui::ref<nanogui::Shader> m_shader;
     nanogui::ref<nanogui::Texture> m_texture;
     nanogui::ref<nanogui::RenderPass> m_renderPass;
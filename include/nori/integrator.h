@@ -41,6 +41,27 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Render all samples of a set of pixels at once (optional)
+     *
+     * By default, the renderer computes one sample at a time using
+     * \ref Li(). Integrators that trace many paths together (such as the
+     * wavefront path tracer) override this function and return \c true.
+     *
+     * \param block
+     *    Receives the samples (it has already been cleared)
+     * \param pixels
+     *    Pixels to be rendered (in image coordinates)
+     * \param sampleCount
+     *    Number of samples per pixel
+     * \return
+     *    \c false if the integrator doesn't implement this function
+     */
+    virtual bool renderPixels(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                              const std::vector<Point2i> &pixels, uint32_t sampleCount) const {
+        return false;
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -0,0 +1,122 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/// A point on an emitter triangle, as sampled by \ref LightBVH::sample()
+struct EmitterSample {
+    Point3f p;                    ///< Position of the sample
+    Normal3f n;                   ///< Surface normal at the sample
+    const Mesh *mesh = nullptr;   ///< Emitter mesh
+    uint32_t prim = 0;            ///< Triangle of \c mesh
+    float pdf = 0;                ///< Density with respect to surface area
+};
+
+/**
+ * \brief Hierarchy over the triangles of all emitters for many-light sampling
+ *
+ * Every node stores the bounding box, the total power and a cone bounding
+ * the emission directions of the triangles below it. To sample an emitter,
+ * the hierarchy is traversed from the root, choosing each child with a
+ * probability proportional to an estimate of its contribution to the
+ * shading point (based on distance, orientation and power). Triangles that
+ * can't illuminate the shading point at all are never chosen, which makes
+ * next event estimation effective even with thousands of emitters.
+ *
+ * \ref pdf() retraces the same decisions using a bit trail stored for
+ * every triangle, so that the sampling density can be used for multiple
+ * importance sampling.
+ */
+class LightBVH {
+public:
+    /// Build the hierarchy over all triangles of the given emitters
+    void build(const std::vector<Mesh *> &emitters);
+
+    /// Does the hierarchy contain any emitters?
+    bool empty() const { return m_nodes.empty(); }
+
+    /**
+     * \brief Sample a point on an emitter for the given shading point
+     *
+     * \param p
+     *    Position of the shading point
+     * \param n
+     *    Surface normal at the shading point (a zero vector if unknown)
+     * \param sample
+     *    A uniformly distributed number that chooses the triangle
+     * \param sample2
+     *    A uniformly distributed sample on \f$[0,1]^2\f$ that chooses
+     *    the point on the triangle
+     * \return
+     *    \c false if no emitter can illuminate the shading point
+     */
+    bool sample(const Point3f &p, const Normal3f &n, float sample,
+                const Point2f &sample2, EmitterSample &eRec) const;
+
+    /**
+     * \brief Return the area density of sampling a point on triangle
+     * \c prim of \c mesh from the given shading point
+     */
+    float pdf(const Point3f &p, const Normal3f &n, const Mesh *mesh, uint32_t prim) const;
+
+    /// Return the total number of emitter triangles
+    size_t getLightCount() const { return m_lights.size(); }
+
+    /// Return the number of nodes of the hierarchy
+    size_t getNodeCount() const { return m_nodes.size(); }
+
+private:
+    /// Spatial and directional bounds of a set of emitting triangles
+    struct LightBounds {
+        BoundingBox3f bbox;
+        Vector3f w = Vector3f(0, 0, 1); ///< Axis of the normal cone
+        float phi = 0;                  ///< Total power
+        float cosTheta_o = 1;           ///< Cosine of the spread of the normals around \c w
+        float cosTheta_e = 0;           ///< Cosine of the spread of the emission around the normals
+
+        /// Importance of the bounded triangles for a shading point
+        float importance(const Point3f &p, const Normal3f &n) const;
+
+        /// Return bounds of the union of two sets
+        static LightBounds merge(const LightBounds &a, const LightBounds &b);
+    };
+
+    /// Emitter triangle referenced by a leaf
+    struct Light {
+        const Mesh *mesh;
+        uint32_t prim;
+        float area;
+    };
+
+    /// Node of the hierarchy (leaves contain exactly one triangle)
+    struct Node {
+        LightBounds bounds;
+        uint32_t index;   ///< Leaf: index of the triangle, inner node: second child
+        bool leaf;
+    };
+
+    /// Light during construction
+    struct BuildLight {
+        LightBounds bounds;
+        uint32_t light;
+    };
+
+    /// Recursively build the hierarchy and return the index of the root
+    uint32_t buildRecursive(BuildLight *lights, uint32_t start, uint32_t end,
+                            uint64_t bitTrail, int depth);
+
+    std::vector<Node> m_nodes;       ///< Nodes in depth-first order
+    std::vector<Light> m_lights;     ///< All emitter triangles
+    std::vector<uint64_t> m_trails;  ///< Path from the root to each triangle (one bit per level)
+    std::unordered_map<const Mesh *, uint32_t> m_meshOffset; ///< Index of the first triangle of a mesh
+};
+
+NORI_NAMESPACE_END
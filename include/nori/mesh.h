@@ -9,9 +9,10 @@
 #include <nori/object.h>
 #include <nori/frame.h>
 #include <nori/bbox.h>
-#include <nori/dpdf.h>
+#include <nori/alias.h>
 #include <nori/emitter.h>
 #include <nori/bsdf.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -22,6 +23,11 @@ NORI_NAMESPACE_BEGIN
  * This includes the position, traveled ray distance, uv coordinates, as well
  * as well as two local coordinate frames (one that corresponds to the true
  * geometry, and one that is used for shading computations).
+ *
+ * Queries that only need to know what was hit (\ref Accel::rayIntersect()
+ * with \c resolve set to \c false) leave the surface properties
+ * uninitialized; only \ref t, \ref mesh, \ref primIdx and \ref bary
+ * are valid until \ref resolve() is called.
  */
 struct Intersection {
     /// Position of the surface intersection
@@ -36,11 +42,20 @@ struct Intersection {
     Frame geoFrame;
     /// Pointer to the associated mesh
     const Mesh *mesh;
+    /// Index of the intersected triangle
     uint32_t primIdx;
+    /// Barycentric coordinates of the hit with respect to vertices 1 and 2
+    Point2f bary;
 
     /// Create an uninitialized intersection record
     Intersection() : mesh(nullptr) { }
 
+    /**
+     * \brief Compute the position, uv coordinates and frames from
+     * \ref mesh, \ref primIdx and \ref bary
+     */
+    void resolve();
+
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
         return shFrame.toLocal(d);
@@ -55,6 +70,31 @@ struct Intersection {
     std::string toString() const;
 };
 
+/**
+ * \brief Geometry buffers of a triangle mesh
+ *
+ * Meshes that are loaded from the same file share a single instance of this
+ * data structure (see \ref Mesh::isInstance()). All buffers are 16-byte
+ * aligned and padded by one trailing element, which is the layout that Embree
+ * expects from shared geometry buffers. This lets the acceleration data
+ * structure reference the mesh data directly instead of keeping a second copy.
+ */
+struct MeshData {
+    typedef std::vector<float, Eigen::aligned_allocator<float>> FloatBuffer;
+    typedef std::vector<uint32_t, Eigen::aligned_allocator<uint32_t>> IndexBuffer;
+
+    uint32_t vertexCount = 0;    ///< Number of vertices
+    uint32_t triangleCount = 0;  ///< Number of triangles
+    FloatBuffer V;               ///< Vertex positions, 3 * N (+ padding)
+    FloatBuffer N;               ///< Vertex normals, empty or 3 * N (+ padding)
+    FloatBuffer UV;              ///< Texture coordinates, empty or 2 * N (+ padding)
+    IndexBuffer F;               ///< Faces, 3 * N (+ padding)
+
+    /// Allocate (uninitialized) storage for the given number of elements
+    MeshData(uint32_t vertexCount, uint32_t triangleCount,
+             bool hasNormals = false, bool hasTexCoords = false);
+};
+
 /**
  * \brief Triangle mesh
  *
@@ -93,6 +133,18 @@ public:
     //// Return the centroid of the given triangle
     Point3f getCentroid(uint32_t index) const;
 
+    /// Return the world space position of the given vertex
+    Point3f getVertexPosition(uint32_t index) const {
+        Point3f p = m_V.col(index);
+        return m_instance ? m_toWorld * p : p;
+    }
+
+    /// Return the (normalized) world space normal of the given vertex
+    Normal3f getVertexNormal(uint32_t index) const {
+        Normal3f n = m_N.col(index);
+        return m_instance ? Normal3f((m_toWorld * n).normalized()) : n;
+    }
+
     /** \brief Ray-triangle intersection test
      *
      * Uses the algorithm by Moeller and Trumbore discussed at
@@ -120,17 +172,46 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
-    /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    /**
+     * \brief Return a pointer to the vertex positions
+     *
+     * For instances, these are given in object space (see \ref getToWorld())
+     */
+    const MatrixXfMap &getVertexPositions() const { return m_V; }
 
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    const MatrixXfMap &getVertexNormals() const { return m_N; }
 
     /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    const MatrixXfMap &getVertexTexCoords() const { return m_UV; }
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MatrixXuMap &getIndices() const { return m_F; }
+
+    /// Return the (possibly shared) geometry buffers of this mesh
+    const std::shared_ptr<MeshData> &getData() const { return m_data; }
+
+    /**
+     * \brief Is this mesh an instance?
+     *
+     * The geometry of an instance is stored in object space and may be shared
+     * with other meshes. \ref getToWorld() maps it into world space.
+     */
+    bool isInstance() const { return m_instance; }
+
+    /// Return the object-to-world transformation of an instance
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /**
+     * \brief Turn an instance into a regular mesh
+     *
+     * This applies the object-to-world transformation to the geometry. The
+     * buffers are modified in place if no other mesh references them, and
+     * copied otherwise. It is used for meshes whose geometry is not shared
+     * with any other mesh, which can then be stored without an instance
+     * transform.
+     */
+    virtual void bakeTransform();
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -155,6 +236,16 @@ public:
 
     Point3f sampleUniformPts(Sampler* sampler, Vector3f &normal, float &pdf, uint32_t index);
 
+    /**
+     * \brief Uniformly sample a point on the given triangle
+     *
+     * \param sample
+     *     A uniformly distributed sample on \f$[0,1]^2\f$
+     * \param normal
+     *     Receives the (interpolated) surface normal at the sampled point
+     */
+    Point3f sampleTriangle(uint32_t index, const Point2f &sample, Normal3f &normal) const;
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
      * provided by this instance
@@ -165,16 +256,32 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Use the given geometry buffers
+     *
+     * \ref m_V, \ref m_N, \ref m_UV and \ref m_F are re-seated to point to
+     * the storage of \c data.
+     *
+     * \param toWorld
+     *     Object-to-world transformation. Unless this is the identity, the
+     *     mesh becomes an instance of the (object space) geometry.
+     */
+    void setData(const std::shared_ptr<MeshData> &data,
+                 const Transform &toWorld = Transform());
+
 protected:
     std::string m_name;                  ///< Identifying name
     float       m_surface = 0;
-    MatrixXf      m_V;                   ///< Vertex positions, 3 * N
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces, 3 * N
+    std::shared_ptr<MeshData> m_data;    ///< Storage of the buffers below
+    MatrixXfMap   m_V{nullptr, 3, 0};    ///< Vertex positions, 3 * N
+    MatrixXfMap   m_N{nullptr, 3, 0};    ///< Vertex normals
+    MatrixXfMap   m_UV{nullptr, 2, 0};   ///< Vertex texture coordinates
+    MatrixXuMap   m_F{nullptr, 3, 0};    ///< Faces, 3 * N
+    Transform     m_toWorld;             ///< Object-to-world transformation
+    bool          m_instance = false;    ///< Are the buffers in object space?
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
-    DiscretePDF *m_dpdf = nullptr;
+    AliasPDF     *m_dpdf = nullptr;      ///< Triangle selection by area (emitters only)
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
 };
 
@@ -30,6 +30,7 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EAccel,
         EClassTypeCount
     };
 
@@ -86,6 +87,7 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EAccel:      return "accel";
             default:          return "<unknown>";
         }
     }
@@ -85,6 +85,25 @@ public:
     /// Return the number of configured pixel samples
     virtual size_t getSampleCount() const { return m_sampleCount; }
 
+    /**
+     * \brief Set the index of the current progressive rendering pass
+     *
+     * This is taken into account by \ref prepare(), so that the passes
+     * of a progressive render generate different samples. Renders that
+     * consist of a single pass use pass 0.
+     */
+    void setPass(uint32_t pass) { m_pass = pass; }
+
+    /**
+     * \brief Select one of several independent sample streams
+     *
+     * When the samples of a single image block are split across several
+     * threads, each of them uses a different stream so that they don't
+     * generate the same samples. Like the pass index, this is taken into
+     * account by \ref prepare(). Stream 0 is the default.
+     */
+    void setStream(uint32_t stream) { m_stream = stream; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
      * provided by this instance
@@ -92,6 +111,8 @@ public:
     EClassType getClassType() const { return ESampler; }
 protected:
     size_t m_sampleCount;
+    uint32_t m_pass = 0;
+    uint32_t m_stream = 0;
 };
 
 NORI_NAMESPACE_END
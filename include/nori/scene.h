@@ -7,6 +7,9 @@
 #pragma once
 
 #include <nori/accel.h>
+#include <nori/dpdf.h>
+#include <nori/lightbvh.h>
+#include <unordered_map>
 
 NORI_NAMESPACE_BEGIN
 
@@ -28,7 +31,37 @@ public:
     /// Return a pointer to the scene's kd-tree
     const Accel *getAccel() const { return m_accel; }
 
-    const std::vector<Mesh*> getEmitters() const { return m_emitters; }
+    /// Return a reference to an array containing all emitter meshes
+    const std::vector<Mesh*> &getEmitters() const { return m_emitters; }
+
+    /**
+     * \brief Choose an emitter with a probability proportional to its power
+     *
+     * The power of an emitter is the luminance of its radiance times its
+     * surface area, so that a bright key light is sampled much more often
+     * than many dim fixtures. The distribution is built by \ref activate().
+     *
+     * \param sample
+     *    A uniformly distributed number in [0, 1)
+     * \param pdf
+     *    Receives the probability of choosing the returned emitter
+     * \return
+     *    The chosen emitter mesh (\c nullptr if there are no emitters).
+     *    Emitters without any radiance are never chosen, unless all of
+     *    them are dark (in which case the choice is uniform)
+     */
+    Mesh *sampleEmitter(float sample, float &pdf) const;
+
+    /// Return the probability that \ref sampleEmitter() chooses \c emitter
+    float pdfEmitter(const Mesh *emitter) const;
+
+    /**
+     * \brief Return the hierarchy over all emitter triangles
+     *
+     * Unlike \ref sampleEmitter(), it chooses emitters based on their
+     * contribution to a specific shading point (see \ref LightBVH)
+     */
+    const LightBVH &getLightBVH() const { return m_lightBVH; }
 
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
@@ -45,6 +78,18 @@ public:
     /// Return a pointer to the scene's sample generator
     Sampler *getSampler() { return m_sampler; }
 
+    /**
+     * \brief Replace the camera and return the previous one
+     *
+     * The scene takes ownership of \c camera and releases ownership of the
+     * returned camera. Since the camera isn't part of the acceleration data
+     * structure, this allows rendering several views of an activated scene.
+     */
+    Camera *setCamera(Camera *camera);
+
+    /// Replace the sampler and return the previous one (see \ref setCamera())
+    Sampler *setSampler(Sampler *sampler);
+
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
@@ -86,6 +131,49 @@ public:
         return m_accel->rayIntersect(ray, its, true);
     }
 
+    /**
+     * \brief Check whether the segment between two points is unoccluded
+     *
+     * This is the visibility test of emitter sampling. It uses an any-hit
+     * query, which is much cheaper than finding the closest intersection.
+     *
+     * \param ignoreMesh
+     *    Hits on this mesh (e.g. the sampled emitter) don't count
+     *
+     * \param origin
+     *    If specified, hits on the triangle of this intersection don't
+     *    count either
+     */
+    bool visible(const Point3f &p, const Point3f &q, const Mesh *ignoreMesh = nullptr,
+                 const Intersection *origin = nullptr) const {
+        OcclusionFilter filter;
+        filter.ignoreMesh = ignoreMesh;
+        if (origin) {
+            filter.selfMesh = origin->mesh;
+            filter.selfPrim = origin->primIdx;
+        }
+        return !m_accel->rayOccluded(Ray3f(p, q - p, 1e-6f, 1 - 1e-6f), filter);
+    }
+
+    /**
+     * \brief Intersect a batch of rays against all triangles stored in the
+     * scene and return detailed intersection information
+     *
+     * The rays are traced together as SIMD packets, which is considerably
+     * faster than issuing one \ref rayIntersect() call per ray.
+     */
+    void rayIntersect(const RayBatch &rays, HitBatch &hits) const {
+        m_accel->rayIntersect(rays, hits);
+    }
+
+    /**
+     * \brief Determine for each ray of a batch whether or not there is an
+     * intersection (the batched counterpart of a shadow ray query)
+     */
+    void rayOccluded(const RayBatch &rays, HitBatch &hits) const {
+        m_accel->rayOccluded(rays, hits);
+    }
+
     /// \brief Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const {
         return m_accel->getBoundingBox();
@@ -109,6 +197,10 @@ public:
 private:
     std::vector<Mesh *> m_meshes;
     std::vector<Mesh*> m_emitters;
+    DiscretePDF m_emitterPDF;                          ///< Emitter selection by power
+    std::vector<Mesh*> m_sampledEmitters;              ///< Emitters with nonzero power (entries of \ref m_emitterPDF)
+    std::unordered_map<const Mesh *, size_t> m_emitterIndex; ///< Position in \ref m_sampledEmitters
+    LightBVH m_lightBVH;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
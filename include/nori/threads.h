@@ -0,0 +1,54 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <functional>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Create the thread pool shared by scene loading, acceleration
+ * data structure construction and rendering
+ *
+ * All parallel work runs in a single TBB task arena, which prevents the
+ * different stages from oversubscribing the machine. This function must be
+ * called before any work is submitted; otherwise, a pool using all cores is
+ * created on first use.
+ *
+ * \param threadCount
+ *     Number of threads (<= 0: one per available core)
+ * \param pinThreads
+ *     Pin each thread to a separate core (Linux only)
+ * \param numaNode
+ *     Restrict the pool to the cores of one NUMA node, which
+ *     allows running one process per socket (< 0: all nodes)
+ */
+extern void initThreadPool(int threadCount = -1, bool pinThreads = false, int numaNode = -1);
+
+/// Return the number of threads of the shared pool
+extern int getThreadCount();
+
+/**
+ * \brief Run a function in the shared thread pool
+ *
+ * Parallel algorithms (e.g. \c tbb::parallel_for) that are invoked by
+ * \c func use the threads of the pool. This also applies to Embree
+ * builds when Embree uses TBB for its tasking.
+ *
+ * When threads are pinned, only the workers of the pool are pinned by
+ * default. Threads started by the caller inside \c func (e.g. by Embree
+ * without TBB tasking during scene loading) inherit its affinity, and
+ * would otherwise all share a single core.
+ *
+ * \param pinCaller
+ *     Also pin the calling thread to a core while \c func runs (e.g.
+ *     for the thread that renders the image)
+ */
+extern void runInThreadPool(const std::function<void()> &func, bool pinCaller = false);
+
+NORI_NAMESPACE_END
@@ -0,0 +1,33 @@
+# Renders resume.xml without interruption, and once more in two runs: the
+# first one stops after three passes, and the second one resumes from its
+# checkpoint with a different thread count. Both images must be identical.
+# The image only has two blocks, so that they are split across threads.
+#
+# Usage: cmake -DNORI=<path to nori> -DWORK_DIR=<scratch directory> -P test-resume.cmake
+
+get_filename_component(SCENE_DIR ${CMAKE_CURRENT_LIST_DIR} ABSOLUTE)
+set(FLAGS --no-gui --spp 8 --pass-spp 1)
+
+function(run_nori dir)
+  execute_process(COMMAND ${NORI} ${dir}/resume.xml ${FLAGS} ${ARGN} RESULT_VARIABLE result)
+  if (NOT result EQUAL 0)
+    message(FATAL_ERROR "nori ${ARGN} failed (${result})")
+  endif()
+endfunction()
+
+foreach (dir full resumed)
+  file(REMOVE_RECURSE ${WORK_DIR}/${dir})
+  file(COPY ${SCENE_DIR}/resume.xml ${SCENE_DIR}/floor.obj ${SCENE_DIR}/polylum1.obj
+       DESTINATION ${WORK_DIR}/${dir})
+endforeach()
+
+run_nori(${WORK_DIR}/full --threads 4)
+run_nori(${WORK_DIR}/resumed --threads 4 --checkpoint 0 --max-passes 3)
+run_nori(${WORK_DIR}/resumed --threads 2 --checkpoint 0 --resume)
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files
+                ${WORK_DIR}/full/resume.exr ${WORK_DIR}/resumed/resume.exr
+                RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+  message(FATAL_ERROR "The resumed render differs from the uninterrupted one")
+endif()
@@ -21,32 +21,13 @@ void Accel::addMesh(Mesh *mesh) {
     m_bbox = m_mesh->getBoundingBox();*/
 }
 
-void Accel::build() {
-    /* Nothing to do here for now */
-    if (m_meshes.empty())
-        return;
-    //Octree deprecated, now use embree
-    /*OctreeNode::V tris(m_mesh->getTriangleCount(), 0);
-    for (int i = 0; i < tris.size(); i++)
-        tris[i] = i;
-    m_root = OctreeNode::build(m_mesh->getBoundingBox(), tris, 1, m_mesh);*/
-    m_emAccel = new EmAccel(m_meshes);
-
-    /*std::cout << "construction completed, total node number: " << node_count << std::endl;
-    std::cout << "leaf nodes number: " << leaf_node_count << std::endl;
-    std::cout << "leaf avg depth: " << leaf_node_depth_count / float(leaf_node_count) << std::endl;
-    std::cout << "leaf avg triangles num: " << leaf_node_tri_count / float(leaf_node_count) << std::endl;*/
-}
-
-bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
+bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay, bool resolve) const {
     bool foundIntersection = false;  // Was an intersection found so far?
     uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
 
     Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
 
-    // we got a ray, want to get the intersection result using the octree node
-    //foundIntersection = m_root->RayIntersect(ray, its, shadowRay, f);
-    foundIntersection = m_emAccel->RayIntersect(ray, its, shadowRay, f);
+    foundIntersection = traceRay(ray, its, shadowRay, f);
 
     //// Brute force search through all triangles
     //for (uint32_t idx = 0; idx < m_mesh->getTriangleCount(); ++idx) {
@@ -66,61 +47,50 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
     
 
     if (foundIntersection && !shadowRay) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
-        }
         its.primIdx = f;
+        if (resolve)
+            its.resolve();
     }
 
     return foundIntersection;
 }
 
+void Accel::rayIntersect(const RayBatch &rays, HitBatch &hits) const {
+    traceRays(rays, hits, false);
+
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (hits.hit[i])
+            hits.its[i].resolve();
+    }
+}
+
+void Accel::rayOccluded(const RayBatch &rays, HitBatch &hits) const {
+    traceRays(rays, hits, true);
+}
+
+void Accel::traceRays(const RayBatch &rays, HitBatch &hits, bool shadowRay) const {
+    hits.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        Ray3f ray(rays.rays[i]);
+        Intersection &its = hits.its[i];
+        hits.hit[i] = traceRay(ray, its, shadowRay, its.primIdx);
+    }
+}
+
+bool Accel::traceOccluded(const Ray3f &ray_, const OcclusionFilter &filter) const {
+    Ray3f ray(ray_);
+    Intersection its;
+    uint32_t f;
+
+    while (traceRay(ray, its, false, f)) {
+        if (!filter.ignores(its.mesh, f))
+            return true;
+        /* Continue behind the ignored hit */
+        ray.mint = std::nextafter(its.t, std::numeric_limits<float>::infinity());
+        ray.maxt = ray_.maxt;
+    }
+    return false;
+}
+
 NORI_NAMESPACE_END
 
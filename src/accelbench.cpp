@@ -0,0 +1,139 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/timer.h>
+#include <pcg32.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Closest-hit throughput benchmark for the acceleration data structure
+ *
+ * For each nested scene, this test generates a fixed set of camera rays and
+ * traces them through \ref Scene::rayIntersect(), both one at a time and as
+ * \ref RayBatch queries. The throughput is reported in millions of rays per
+ * second, which makes it easy to compare traversal changes across builds.
+ *
+ * With \c retest enabled, the scalar query is also timed with a second
+ * Moller-Trumbore test of the hit triangle (\ref Mesh::rayIntersect()),
+ * which is what the Embree accelerator used to do after every hit. Both
+ * throughputs are printed next to each other.
+ */
+class AccelBenchmark : public NoriObject {
+public:
+    AccelBenchmark(const PropertyList &propList) {
+        /* Number of camera rays traced per scene (default: 1M) */
+        m_rayCount = propList.getInteger("rayCount", 1000000);
+
+        /* Number of rays per batched query */
+        m_batchSize = propList.getInteger("batchSize", 64);
+
+        /* Also time the scalar query with a re-test of each hit */
+        m_retest = propList.getBoolean("retest", false);
+    }
+
+    virtual ~AccelBenchmark() {
+        for (auto scene : m_scenes)
+            delete scene;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EScene:
+                m_scenes.push_back(static_cast<Scene *>(obj));
+                break;
+
+            default:
+                throw NoriException("AccelBenchmark::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Invoke the actual benchmark
+    void activate() {
+        for (auto scene : m_scenes) {
+            const Camera *camera = scene->getCamera();
+            Vector2f outputSize = camera->getOutputSize().cast<float>();
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Benchmarking scene: " << scene->toString() << endl;
+
+            /* Generate the rays up front so that only traversal is timed */
+            pcg32 random;
+            std::vector<Ray3f> rays(m_rayCount);
+            for (auto &ray : rays) {
+                Point2f pixelSample(random.nextFloat() * outputSize.x(),
+                                    random.nextFloat() * outputSize.y());
+                Point2f apertureSample(random.nextFloat(), random.nextFloat());
+                camera->sampleRay(ray, pixelSample, apertureSample);
+            }
+
+            int hitCount = 0;
+            Intersection its;
+            Timer timer;
+            for (const auto &ray : rays)
+                hitCount += scene->rayIntersect(ray, its) ? 1 : 0;
+            report("closest hit (scalar)", timer.elapsed(), hitCount);
+
+            if (m_retest) {
+                hitCount = 0;
+                timer.reset();
+                for (const auto &ray : rays) {
+                    if (!scene->rayIntersect(ray, its))
+                        continue;
+                    float u, v, t;
+                    hitCount += its.mesh->rayIntersect(its.primIdx, ray, u, v, t) ? 1 : 0;
+                }
+                report("closest hit + re-test", timer.elapsed(), hitCount);
+            }
+
+            hitCount = 0;
+            RayBatch batch;
+            HitBatch hits;
+            timer.reset();
+            for (size_t i = 0; i < rays.size(); i += m_batchSize) {
+                batch.clear();
+                for (size_t j = i; j < std::min(rays.size(), i + m_batchSize); ++j)
+                    batch.add(rays[j]);
+                scene->rayIntersect(batch, hits);
+                for (size_t j = 0; j < hits.size(); ++j)
+                    hitCount += hits.hit[j];
+            }
+            report("closest hit (batched)", timer.elapsed(), hitCount);
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "AccelBenchmark[\n"
+            "  rayCount = %i,\n"
+            "  batchSize = %i,\n"
+            "  retest = %s\n"
+            "]",
+            m_rayCount,
+            m_batchSize,
+            m_retest ? "true" : "false"
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    void report(const std::string &name, double ms, int hitCount) const {
+        double mrays = ms > 0 ? m_rayCount / (ms * 1000.0) : 0.0;
+        cout << tfm::format("%-24s %8.2f Mrays/s (%s, %i hits)",
+            name, mrays, timeString(ms, true), hitCount) << endl;
+    }
+
+    std::vector<Scene *> m_scenes;
+    int m_rayCount;
+    size_t m_batchSize;
+    bool m_retest;
+};
+
+NORI_REGISTER_CLASS(AccelBenchmark, "accelbench");
+NORI_NAMESPACE_END
@@ -21,16 +21,21 @@ public:
         Point3f pos = its.p;
         float sum = 0;
         pcg32 rng;
+        RayBatch shadowRays;
+        HitBatch shadowHits;
         for (int i = 0; i < sampleNum; i++) {
             float xi1 = rng.nextFloat(), xi2 = rng.nextFloat();
             float theta = acos(sqrt(xi1)), phi = 2 * M_PI * xi2;
             Vector3f sampleDir(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta));
             // to world space
             sampleDir = its.geoFrame.toWorld(sampleDir);
-            Ray3f shadowRay(pos, sampleDir, 0.001, FLT_MAX);
-            if (!scene->rayIntersect(shadowRay))
-                sum += 1;
+            shadowRays.add(Ray3f(pos, sampleDir, 0.001, FLT_MAX));
         }
+        // trace all shadow rays of this point as packets
+        scene->rayOccluded(shadowRays, shadowHits);
+        for (size_t i = 0; i < shadowHits.size(); i++)
+            if (!shadowHits.hit[i])
+                sum += 1;
         sum /= sampleNum;
         return Color3f(sum);
     }
@@ -9,6 +9,11 @@
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
 #include <tbb/tbb.h>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfStringAttribute.h>
+#include <iostream>
 
 NORI_NAMESPACE_BEGIN
 
@@ -34,6 +39,9 @@ ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
 
     /* Allocate space for pixels and border regions */
     resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+
+    /* Row stripes that can be merged into independently */
+    m_rowLocks = std::vector<tbb::mutex>((rows() + NORI_BLOCK_LOCK_ROWS - 1) / NORI_BLOCK_LOCK_ROWS);
 }
 
 ImageBlock::~ImageBlock() {
@@ -42,6 +50,30 @@ ImageBlock::~ImageBlock() {
     delete[] m_weightsY;
 }
 
+void ImageBlock::setMomentsEnabled(bool enabled) {
+    /* Same layout as the pixels (including the border), three values per pixel */
+    if (enabled)
+        m_moments.setZero(rows(), 3 * cols());
+    else
+        m_moments.resize(0, 0);
+}
+
+float ImageBlock::getRelativeError(const Point2i &pixel) const {
+    int x = pixel.x() + m_borderSize, y = pixel.y() + m_borderSize;
+    float n = m_moments(y, 3*x), sum = m_moments(y, 3*x + 1), sumSq = m_moments(y, 3*x + 2);
+    if (n < 2)
+        return std::numeric_limits<float>::infinity();
+
+    float mean = sum / n;
+    float variance = std::max(0.f, (sumSq - sum * mean) / (n - 1));
+    if (variance == 0)
+        return 0.f;
+
+    /* Standard error of the mean relative to the mean. Dark
+       pixels are compared against a small absolute threshold */
+    return std::sqrt(variance / n) / std::max(mean, 1e-3f);
+}
+
 Bitmap *ImageBlock::toBitmap() const {
     Bitmap *result = new Bitmap(m_size);
     for (int y=0; y<m_size.y(); ++y)
@@ -88,6 +120,17 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
     for (int y=bbox.min.y(), yr=0; y<=bbox.max.y(); ++y, ++yr) 
         for (int x=bbox.min.x(), xr=0; x<=bbox.max.x(); ++x, ++xr) 
             coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
+
+    if (hasMoments()) {
+        /* Statistics are recorded in the pixel that contains the sample */
+        int x = (int) std::floor(pos.x() + 0.5f), y = (int) std::floor(pos.y() + 0.5f);
+        if (x >= 0 && y >= 0 && x < cols() && y < rows()) {
+            float lum = value.getLuminance();
+            m_moments(y, 3*x) += 1;
+            m_moments(y, 3*x + 1) += lum;
+            m_moments(y, 3*x + 2) += lum * lum;
+        }
+    }
 }
     
 void ImageBlock::put(ImageBlock &b) {
@@ -95,10 +138,120 @@ void ImageBlock::put(ImageBlock &b) {
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    bool moments = hasMoments() && b.hasMoments();
+
+    /* Merge one row stripe at a time (in increasing order), so that
+       blocks only contend for the rows that they actually share */
+    for (int y = offset.y(); y < offset.y() + size.y(); ) {
+        int stripe = y / NORI_BLOCK_LOCK_ROWS;
+        int rowCount = std::min((stripe + 1) * NORI_BLOCK_LOCK_ROWS, offset.y() + size.y()) - y;
+        int srcY = y - offset.y();
+
+        tbb::mutex::scoped_lock lock(m_rowLocks[stripe]);
+
+        block(y, offset.x(), rowCount, size.x())
+            += b.block(srcY, 0, rowCount, size.x());
+
+        if (moments)
+            m_moments.block(y, 3 * offset.x(), rowCount, 3 * size.x())
+                += b.m_moments.block(srcY, 0, rowCount, 3 * size.x());
+
+        y += rowCount;
+    }
+}
+
+void ImageBlock::snapshot(Base &target) const {
+    target.resize(rows(), cols());
+    for (int stripe = 0; stripe < (int) m_rowLocks.size(); ++stripe) {
+        int y = stripe * NORI_BLOCK_LOCK_ROWS;
+        int rowCount = std::min(NORI_BLOCK_LOCK_ROWS, (int) rows() - y);
+
+        tbb::mutex::scoped_lock lock(m_rowLocks[stripe]);
+        target.middleRows(y, rowCount) = middleRows(y, rowCount);
+    }
+}
+
+void ImageBlock::save(std::ostream &os) const {
+    int32_t dims[3] = { (int32_t) rows(), (int32_t) cols(), hasMoments() ? 1 : 0 };
+    os.write((const char *) dims, sizeof(dims));
+    os.write((const char *) data(), sizeof(Color4f) * size());
+    if (hasMoments())
+        os.write((const char *) m_moments.data(), sizeof(float) * m_moments.size());
+}
+
+void ImageBlock::load(std::istream &is) {
+    int32_t dims[3];
+    is.read((char *) dims, sizeof(dims));
+    if (!is || dims[0] != rows() || dims[1] != cols() || (dims[2] != 0) != hasMoments())
+        throw NoriException("ImageBlock::load(): incompatible image block!");
+    is.read((char *) data(), sizeof(Color4f) * size());
+    if (hasMoments())
+        is.read((char *) m_moments.data(), sizeof(float) * m_moments.size());
+    if (!is)
+        throw NoriException("ImageBlock::load(): unexpected end of file!");
+}
+
+/// Channels of partial OpenEXR files (in the order of the Color4f components)
+static const char *partialChannels[4] = { "R", "G", "B", "W" };
+
+void ImageBlock::saveEXR(const std::string &filename) const {
+    cout << "Writing a " << m_size.x() << "x" << m_size.y()
+         << " partial OpenEXR file to \"" << filename << "\"" << endl;
+
+    std::string path = filename + ".exr";
+
+    Imf::Header header(m_size.x(), m_size.y());
+    header.insert("comments", Imf::StringAttribute("Partial render generated by Nori"));
+
+    Imf::ChannelList &channels = header.channels();
+    for (int i = 0; i < 4; ++i)
+        channels.insert(partialChannels[i], Imf::Channel(Imf::FLOAT));
+
+    /* Point the slices at the first pixel inside of the border */
+    Imf::FrameBuffer frameBuffer;
+    size_t compStride = sizeof(float),
+           pixelStride = sizeof(Color4f),
+           rowStride = pixelStride * cols();
+
+    char *ptr = reinterpret_cast<char *>(const_cast<Color4f *>(&coeffRef(m_borderSize, m_borderSize)));
+    for (int i = 0; i < 4; ++i, ptr += compStride)
+        frameBuffer.insert(partialChannels[i], Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+
+    Imf::OutputFile file(path.c_str(), header);
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(m_size.y());
+}
+
+void ImageBlock::accumulateEXR(const std::string &filename) {
+    Imf::InputFile file(filename.c_str());
+    const Imf::Header &header = file.header();
+
+    Imath::Box2i dw = header.dataWindow();
+    Vector2i size(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1);
+    if (size != m_size)
+        throw NoriException("\"%s\" has size %ix%i, expected %ix%i!", filename,
+            size.x(), size.y(), m_size.x(), m_size.y());
+    for (int i = 0; i < 4; ++i) {
+        if (!header.channels().findChannel(partialChannels[i]))
+            throw NoriException("\"%s\" is not a partial render (channel %s is missing)!",
+                filename, partialChannels[i]);
+    }
+
+    Base partial(size.y(), size.x());
+    size_t compStride = sizeof(float),
+           pixelStride = sizeof(Color4f),
+           rowStride = pixelStride * size.x();
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+    /* The slices are addressed relative to the origin of the data window */
+    char *ptr = reinterpret_cast<char *>(partial.data())
+        - dw.min.x * pixelStride - dw.min.y * rowStride;
+    Imf::FrameBuffer frameBuffer;
+    for (int i = 0; i < 4; ++i, ptr += compStride)
+        frameBuffer.insert(partialChannels[i], Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+    file.setFrameBuffer(frameBuffer);
+    file.readPixels(dw.min.y, dw.max.y);
+
+    block(m_borderSize, m_borderSize, size.y(), size.x()) += partial;
 }
 
 std::string ImageBlock::toString() const {
@@ -106,49 +259,201 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, EOrder order)
         : m_size(size), m_blockSize(blockSize) {
     m_numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
+    m_blocks.reserve(m_numBlocks.x() * m_numBlocks.y());
+
+    switch (order) {
+        case EHilbert:  generateHilbert(); break;
+        case EScanline: generateScanline(); break;
+        default:        generateSpiral(); break;
+    }
+    m_costs.resize(m_blocks.size(), 0.f);
 }
 
-bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
+void BlockGenerator::addBlock(const Point2i &block) {
+    Point2i pos = block * m_blockSize;
+    m_blocks.push_back(Block { pos, (m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)) });
+}
 
-    if (m_blocksLeft == 0)
-        return false;
+void BlockGenerator::setRange(int first, int last) {
+    last = std::min(last, (int) m_blocks.size());
+    if (first < 0 || first >= last)
+        throw NoriException("Invalid block range %i:%i (the image has %i blocks)!",
+            first, last, (int) m_blocks.size());
+    m_blocks = std::vector<Block>(m_blocks.begin() + first, m_blocks.begin() + last);
+    m_costs.assign(m_blocks.size(), 0.f);
+    reset();
+}
 
-    Point2i pos = m_block * m_blockSize;
-    block.setOffset(pos);
-    block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+BlockGenerator::EOrder BlockGenerator::orderFromString(const std::string &name) {
+    if (name == "spiral")
+        return ESpiral;
+    else if (name == "hilbert")
+        return EHilbert;
+    else if (name == "scanline")
+        return EScanline;
+    throw NoriException("Unknown block order \"%s\" (expected spiral, hilbert or scanline)", name);
+}
 
-    if (--m_blocksLeft == 0)
-        return true;
+void BlockGenerator::generateSpiral() {
+    Point2i block(m_numBlocks / 2);
+    int direction = ERight, numSteps = 1, stepsLeft = 1;
+    int blocksLeft = m_numBlocks.x() * m_numBlocks.y();
 
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
-        }
+    while (blocksLeft > 0) {
+        addBlock(block);
+        if (--blocksLeft == 0)
+            break;
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
+        do {
+            switch (direction) {
+                case ERight: ++block.x(); break;
+                case EDown:  ++block.y(); break;
+                case ELeft:  --block.x(); break;
+                case EUp:    --block.y(); break;
+            }
+
+            if (--stepsLeft == 0) {
+                direction = (direction + 1) % 4;
+                if (direction == ELeft || direction == ERight) 
+                    ++numSteps;
+                stepsLeft = numSteps;
+            }
+        } while ((block.array() < 0).any() ||
+                 (block.array() >= m_numBlocks.array()).any());
+    }
+}
+
+void BlockGenerator::generateHilbert() {
+    /* Walk a Hilbert curve over the smallest enclosing power-of-two
+       grid and keep the blocks that are inside of the image */
+    int n = 1;
+    while (n < m_numBlocks.maxCoeff())
+        n *= 2;
+
+    for (int d = 0; d < n * n; ++d) {
+        int x = 0, y = 0;
+        for (int s = 1, t = d; s < n; s *= 2, t /= 4) {
+            int rx = 1 & (t / 2), ry = 1 & (t ^ rx);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
         }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
+        if (x < m_numBlocks.x() && y < m_numBlocks.y())
+            addBlock(Point2i(x, y));
+    }
+}
+
+void BlockGenerator::generateScanline() {
+    for (int y = 0; y < m_numBlocks.y(); ++y)
+        for (int x = 0; x < m_numBlocks.x(); ++x)
+            addBlock(Point2i(x, y));
+}
+
+bool BlockGenerator::next(ImageBlock &block, int *index_) {
+    int index = m_next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= (int) m_blocks.size())
+        return false;
 
+    getBlock(index, block);
+    if (index_)
+        *index_ = index;
     return true;
 }
 
+void BlockGenerator::getBlock(int index, ImageBlock &block) const {
+    block.setOffset(m_blocks[index].offset);
+    block.setSize(m_blocks[index].size);
+}
+
+void BlockGenerator::schedule(int workerCount) {
+    reset();
+
+    float totalCost = 0;
+    for (float cost : m_costs)
+        totalCost += cost;
+    if (totalCost <= 0)
+        return;
+
+    /* Split blocks that would take a large share of the time of a worker
+       into quadrants. The cost of the quadrants is assumed to be equal */
+    float maxCost = totalCost / (2 * std::max(workerCount, 1));
+    std::vector<Block> blocks;
+    std::vector<float> costs;
+    auto split = [&](auto &self, const Block &b, float cost) -> void {
+        if (cost <= maxCost || b.size.minCoeff() < 2 * NORI_BLOCK_MIN_SIZE) {
+            blocks.push_back(b);
+            costs.push_back(cost);
+            return;
+        }
+        Vector2i half = b.size / 2;
+        for (int i = 0; i < 4; ++i) {
+            Vector2i corner(i & 1, i >> 1);
+            Block sub;
+            sub.offset = b.offset + corner.cwiseProduct(half);
+            sub.size = corner.cwiseProduct(b.size - half) + (Vector2i::Ones() - corner).cwiseProduct(half);
+            self(self, sub, cost / 4);
+        }
+    };
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+        split(split, m_blocks[i], m_costs[i]);
+
+    /* Most expensive blocks first. The sort is stable, so that blocks
+       of similar cost keep their original (e.g. spiral) order */
+    std::vector<int> order(blocks.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = (int) i;
+    std::stable_sort(order.begin(), order.end(),
+        [&](int a, int b) { return costs[a] > costs[b]; });
+
+    m_blocks.resize(blocks.size());
+    m_costs.resize(blocks.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        m_blocks[i] = blocks[order[i]];
+        m_costs[i] = costs[order[i]];
+    }
+}
+
+void BlockGenerator::save(std::ostream &os) const {
+    uint32_t count = (uint32_t) m_blocks.size();
+    os.write((const char *) &count, sizeof(count));
+    for (const Block &b : m_blocks) {
+        int32_t values[4] = { b.offset.x(), b.offset.y(), b.size.x(), b.size.y() };
+        os.write((const char *) values, sizeof(values));
+    }
+    os.write((const char *) m_costs.data(), sizeof(float) * count);
+}
+
+void BlockGenerator::load(std::istream &is) {
+    uint32_t count = 0;
+    is.read((char *) &count, sizeof(count));
+    std::vector<Block> blocks(count);
+    for (Block &b : blocks) {
+        int32_t values[4];
+        is.read((char *) values, sizeof(values));
+        b.offset = Point2i(values[0], values[1]);
+        b.size = Vector2i(values[2], values[3]);
+        if ((b.offset.array() < 0).any() || ((b.offset + b.size).array() > m_size.array()).any())
+            throw NoriException("BlockGenerator::load(): block outside of the image!");
+    }
+    std::vector<float> costs(count);
+    is.read((char *) costs.data(), sizeof(float) * count);
+    if (!is)
+        throw NoriException("BlockGenerator::load(): unexpected end of file!");
+
+    m_blocks = std::move(blocks);
+    m_costs = std::move(costs);
+    reset();
+}
+
 NORI_NAMESPACE_END
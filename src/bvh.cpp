@@ -0,0 +1,318 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/bvh.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/blocked_range.h>
+#include <memory>
+
+/* Subtrees with fewer primitives are built on the current thread */
+#define BVH_PARALLEL_THRESHOLD 4096
+
+/* Maximum depth of the traversal stack */
+#define BVH_STACK_SIZE 64
+
+/* Relative cost of a ray-box test compared to a ray-triangle test */
+#define BVH_TRAVERSAL_COST 0.5f
+
+NORI_NAMESPACE_BEGIN
+
+/// Triangle bounds and centroid, which are reordered during the build
+struct BVH::BuildPrimitive {
+    BoundingBox3f bbox;
+    Point3f centroid;
+    Primitive prim;
+};
+
+/// Temporary tree representation, which is flattened once the build is done
+struct BVH::BuildNode {
+    BoundingBox3f bbox;
+    uint32_t start, end;
+    int axis = 0;
+    std::unique_ptr<BuildNode> children[2];
+};
+
+BVH::BVH(const PropertyList &propList) {
+    /* Maximum number of triangles per leaf */
+    m_maxLeafSize = (uint32_t) propList.getInteger("maxLeafSize", 4);
+    if (m_maxLeafSize < 1 || m_maxLeafSize > 0xFFFF)
+        throw NoriException("BVH: 'maxLeafSize' must be in [1, 65535]!");
+
+    /* Number of bins used to evaluate the surface area heuristic */
+    m_binCount = (uint32_t) propList.getInteger("binCount", 16);
+    if (m_binCount < 2)
+        throw NoriException("BVH: 'binCount' must be at least 2!");
+}
+
+void BVH::build() {
+    m_nodes.clear();
+    m_prims.clear();
+
+    uint32_t primCount = 0;
+    std::vector<uint32_t> meshOffset;
+    for (auto mesh : m_meshes) {
+        meshOffset.push_back(primCount);
+        primCount += mesh->getTriangleCount();
+    }
+    if (primCount == 0)
+        return;
+
+    cout << "Building BVH (" << primCount << " triangles) .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Gather the world space bounds of all triangles */
+    std::vector<BuildPrimitive> prims(primCount);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) m_meshes.size(), 1),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                const Mesh *mesh = m_meshes[i];
+                tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount()),
+                    [&](const tbb::blocked_range<uint32_t> &faces) {
+                        for (uint32_t f = faces.begin(); f != faces.end(); ++f) {
+                            BuildPrimitive &bp = prims[meshOffset[i] + f];
+                            bp.bbox = mesh->getBoundingBox(f);
+                            bp.centroid = bp.bbox.getCenter();
+                            bp.prim = Primitive{ i, f };
+                        }
+                    }
+                );
+            }
+        }
+    );
+
+    std::unique_ptr<BuildNode> root(buildRecursive(prims.data(), 0, primCount, 0));
+
+    /* The leaves now reference consecutive ranges of 'prims' */
+    m_prims.resize(primCount);
+    for (uint32_t i = 0; i < primCount; ++i)
+        m_prims[i] = prims[i].prim;
+    uint32_t maxDepth = 0;
+    flatten(root.get(), 0, maxDepth);
+    m_nodes.shrink_to_fit();
+    if (maxDepth > BVH_STACK_SIZE)
+        throw NoriException("BVH: the hierarchy is too deep (%i levels) for the traversal stack!", maxDepth);
+
+    m_buildTime = timer.elapsed();
+    cout << "done. (" << m_nodes.size() << " nodes, took " << timeString(m_buildTime)
+         << " and " << memString(m_nodes.size() * sizeof(BVHNode) +
+                                 m_prims.size() * sizeof(Primitive))
+         << ")" << endl;
+}
+
+BVH::BuildNode *BVH::buildRecursive(BuildPrimitive *prims, uint32_t start, uint32_t end, uint32_t depth) const {
+    BuildNode *node = new BuildNode();
+    node->start = start;
+    node->end = end;
+
+    BoundingBox3f centroidBounds;
+    for (uint32_t i = start; i < end; ++i) {
+        node->bbox.expandBy(prims[i].bbox);
+        centroidBounds.expandBy(prims[i].centroid);
+    }
+
+    uint32_t count = end - start;
+    if (count <= 1)
+        return node;
+
+    int axis = centroidBounds.getMajorAxis();
+    float minC = centroidBounds.min[axis],
+          extent = centroidBounds.max[axis] - minC;
+    uint32_t mid = start + count / 2;
+
+    if (depth >= BVH_STACK_SIZE / 2) {
+        /* Unbalanced SAH splits could overflow the traversal stack,
+           so continue with object median splits from here on. These
+           halve the range, which bounds the remaining depth by 32 */
+        if (count <= m_maxLeafSize)
+            return node;
+        std::nth_element(prims + start, prims + mid, prims + end,
+            [axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+    } else if (extent > 0) {
+        /* Bin the centroids along the largest axis */
+        std::vector<BoundingBox3f> binBounds(m_binCount);
+        std::vector<uint32_t> binCounts(m_binCount, 0);
+        float scale = m_binCount / extent;
+        auto binIndex = [&](const BuildPrimitive &bp) {
+            uint32_t idx = (uint32_t) ((bp.centroid[axis] - minC) * scale);
+            return std::min(idx, m_binCount - 1);
+        };
+        for (uint32_t i = start; i < end; ++i) {
+            uint32_t idx = binIndex(prims[i]);
+            binBounds[idx].expandBy(prims[i].bbox);
+            binCounts[idx]++;
+        }
+
+        /* Sweep from the right to get the cost of all right partitions */
+        std::vector<float> rightCost(m_binCount, 0.f);
+        BoundingBox3f bounds;
+        uint32_t rightCount = 0;
+        for (uint32_t i = m_binCount - 1; i > 0; --i) {
+            bounds.expandBy(binBounds[i]);
+            rightCount += binCounts[i];
+            rightCost[i] = rightCount > 0 ? bounds.getSurfaceArea() * rightCount : 0.f;
+        }
+
+        /* .. and from the left to find the best split */
+        bounds.reset();
+        uint32_t leftCount = 0, bestSplit = 0;
+        float bestCost = std::numeric_limits<float>::infinity();
+        for (uint32_t i = 1; i < m_binCount; ++i) {
+            bounds.expandBy(binBounds[i - 1]);
+            leftCount += binCounts[i - 1];
+            if (leftCount == 0 || leftCount == count)
+                continue;
+            float cost = bounds.getSurfaceArea() * leftCount + rightCost[i];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = i;
+            }
+        }
+
+        float area = node->bbox.getSurfaceArea();
+        bestCost = BVH_TRAVERSAL_COST + (area > 0 ? bestCost / area : (float) count);
+
+        /* Create a leaf if splitting doesn't pay off */
+        if (count <= m_maxLeafSize && (bestSplit == 0 || bestCost >= (float) count))
+            return node;
+
+        if (bestSplit > 0) {
+            BuildPrimitive *it = std::partition(prims + start, prims + end,
+                [&](const BuildPrimitive &bp) { return binIndex(bp) < bestSplit; });
+            mid = (uint32_t) (it - prims);
+        }
+    } else if (count <= m_maxLeafSize) {
+        return node;
+    }
+    /* Otherwise, all centroids coincide and the range is simply split in half */
+
+    node->axis = axis;
+    if (count > BVH_PARALLEL_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { node->children[0].reset(buildRecursive(prims, start, mid, depth + 1)); },
+            [&] { node->children[1].reset(buildRecursive(prims, mid, end, depth + 1)); }
+        );
+    } else {
+        node->children[0].reset(buildRecursive(prims, start, mid, depth + 1));
+        node->children[1].reset(buildRecursive(prims, mid, end, depth + 1));
+    }
+    return node;
+}
+
+uint32_t BVH::flatten(const BuildNode *node, uint32_t depth, uint32_t &maxDepth) {
+    uint32_t index = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes[index].bbox = node->bbox;
+    m_nodes[index].axis = (uint8_t) node->axis;
+
+    if (!node->children[0]) {
+        maxDepth = std::max(maxDepth, depth);
+        m_nodes[index].offset = node->start;
+        m_nodes[index].count = (uint16_t) (node->end - node->start);
+    } else {
+        m_nodes[index].count = 0;
+        flatten(node->children[0].get(), depth + 1, maxDepth);
+        /* Note: 'm_nodes' may have been reallocated by now */
+        uint32_t second = flatten(node->children[1].get(), depth + 1, maxDepth);
+        m_nodes[index].offset = second;
+    }
+    return index;
+}
+
+/// Slab test that uses the sign of the ray direction to pick the near planes
+static inline bool intersectBox(const BoundingBox3f &bbox, const Ray3f &ray, const int dirIsNeg[3]) {
+    float nearT = ray.mint, farT = ray.maxt;
+    for (int i = 0; i < 3; ++i) {
+        float t0 = ((dirIsNeg[i] ? bbox.max[i] : bbox.min[i]) - ray.o[i]) * ray.dRcp[i];
+        float t1 = ((dirIsNeg[i] ? bbox.min[i] : bbox.max[i]) - ray.o[i]) * ray.dRcp[i];
+        nearT = std::max(nearT, t0);
+        farT = std::min(farT, t1);
+    }
+    return nearT <= farT;
+}
+
+bool BVH::traceRay(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &f) const {
+    return traverse(ray, its, shadowRay, f, nullptr);
+}
+
+bool BVH::traceOccluded(const Ray3f &ray_, const OcclusionFilter &filter) const {
+    Ray3f ray(ray_);
+    Intersection its; /* Unused */
+    uint32_t f;
+    return traverse(ray, its, true, f, &filter);
+}
+
+bool BVH::traverse(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &f,
+                   const OcclusionFilter *filter) const {
+    if (m_nodes.empty())
+        return false;
+
+    bool foundIntersection = false;
+    int dirIsNeg[3] = { ray.d.x() < 0, ray.d.y() < 0, ray.d.z() < 0 };
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stackSize = 0, nodeIdx = 0;
+
+    while (true) {
+        const BVHNode &node = m_nodes[nodeIdx];
+
+        if (intersectBox(node.bbox, ray, dirIsNeg)) {
+            if (!node.isLeaf()) {
+                /* Visit the closer child first and defer the other one */
+                if (dirIsNeg[node.axis]) {
+                    stack[stackSize++] = nodeIdx + 1;
+                    nodeIdx = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIdx = nodeIdx + 1;
+                }
+                continue;
+            }
+
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                const Primitive &prim = m_prims[i];
+                const Mesh *mesh = m_meshes[prim.mesh];
+                if (filter && filter->ignores(mesh, prim.face))
+                    continue;
+                float u, v, t;
+                if (mesh->rayIntersect(prim.face, ray, u, v, t)) {
+                    /* An intersection was found! Can terminate
+                       immediately if this is a shadow ray query */
+                    if (shadowRay)
+                        return true;
+                    ray.maxt = its.t = t;
+                    its.bary = Point2f(u, v);
+                    its.mesh = mesh;
+                    f = prim.face;
+                    foundIntersection = true;
+                }
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        nodeIdx = stack[--stackSize];
+    }
+
+    return foundIntersection;
+}
+
+std::string BVH::toString() const {
+    return tfm::format(
+        "BVH[\n"
+        "  maxLeafSize = %i,\n"
+        "  binCount = %i\n"
+        "]",
+        m_maxLeafSize,
+        m_binCount
+    );
+}
+
+NORI_REGISTER_CLASS(BVH, "bvh");
+NORI_NAMESPACE_END
@@ -9,6 +9,7 @@
 #include <Eigen/LU>
 #include <filesystem/resolver.h>
 #include <iomanip>
+#include <cstdio>
 
 #if defined(PLATFORM_LINUX)
 #include <malloc.h>
@@ -158,6 +159,16 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+bool replaceFile(const std::string &source, const std::string &target) {
+#if defined(PLATFORM_WINDOWS)
+    /* rename() refuses to overwrite an existing file on Windows */
+    return MoveFileExA(source.c_str(), target.c_str(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(source.c_str(), target.c_str()) == 0;
+#endif
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
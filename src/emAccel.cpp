@@ -1,75 +1,261 @@
 ﻿#include <nori/emAccel.h>
+#include <nori/timer.h>
+#include <nori/threads.h>
+#include <tbb/parallel_for.h>
+#include <atomic>
+#include <map>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
-static RTCDevice m_device;
-static RTCScene m_scene;
+// all scenes with the same device configuration share one device, it is created by the first
+// EmAccel and released with the last one. the memory monitor counts the bytes embree allocates.
+struct SharedDevice {
+	RTCDevice device = nullptr;
+	int refCount = 0;
+	std::atomic<ssize_t> bytes{ 0 };
+};
+static std::mutex s_deviceMutex;
+static std::map<std::string, SharedDevice*> s_devices;
+
+static bool MemoryMonitor(void* userPtr, ssize_t bytes, bool post)
+{
+	((SharedDevice*)userPtr)->bytes += bytes;
+	return true;
+}
 
 void EmAccel::InitializeDevice()
 {
-	m_device = rtcNewDevice(NULL);
-	if (!m_device)
-		printf("error %d: cannot create device\n", rtcGetDeviceError(NULL));
-	//rtcSetDeviceErrorFunction(m_device, errorFunction, NULL);
+	std::lock_guard<std::mutex> lock(s_deviceMutex);
+	SharedDevice*& shared = s_devices[m_deviceConfig];
+	if (!shared)
+	{
+		RTCDevice device = rtcNewDevice(m_deviceConfig.empty() ? NULL : m_deviceConfig.c_str());
+		if (!device)
+		{
+			s_devices.erase(m_deviceConfig);
+			throw NoriException("EmAccel: cannot create device \"%s\" (error %i)",
+				m_deviceConfig, (int)rtcGetDeviceError(NULL));
+		}
+		shared = new SharedDevice();
+		shared->device = device;
+		rtcSetDeviceMemoryMonitorFunction(device, MemoryMonitor, shared);
+		//rtcSetDeviceErrorFunction(m_device, errorFunction, NULL);
+	}
+	shared->refCount++;
+	m_device = shared->device;
+}
+
+RTCGeometry EmAccel::NewTriangleGeometry(const Mesh* mesh) const
+{
+	RTCGeometry geom = rtcNewGeometry(m_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+	rtcSetGeometryBuildQuality(geom, m_buildQuality);
+	// the mesh buffers are aligned and padded for embree, so share them instead of copying
+	rtcSetSharedGeometryBuffer(geom,
+		RTC_BUFFER_TYPE_VERTEX,
+		0,
+		RTC_FORMAT_FLOAT3,
+		mesh->getVertexPositions().data(),
+		0,
+		3 * sizeof(float),
+		mesh->getVertexCount());
+
+	rtcSetSharedGeometryBuffer(geom,
+		RTC_BUFFER_TYPE_INDEX,
+		0,
+		RTC_FORMAT_UINT3,
+		mesh->getIndices().data(),
+		0,
+		3 * sizeof(unsigned),
+		mesh->getTriangleCount());
+
+	rtcCommitGeometry(geom);
+	return geom;
+}
+
+RTCScene EmAccel::NewScene() const
+{
+	RTCScene scene = rtcNewScene(m_device);
+	rtcSetSceneBuildQuality(scene, m_buildQuality);
+	// visibility queries pass their filter function in the arguments (see traceOccluded)
+	rtcSetSceneFlags(scene, m_sceneFlags | RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS);
+	return scene;
 }
 
 void EmAccel::InitializeScene()
 {
-	m_scene = rtcNewScene(m_device);
-	// get essential data from the mesh
-	for (int i = 0; i < m_meshes.size(); i++) {
-		uint32_t verCount = m_meshes[i]->getVertexCount();
-		uint32_t triCount = m_meshes[i]->getTriangleCount();
-		RTCGeometry geom = rtcNewGeometry(m_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-		float* vertices = (float*)rtcSetNewGeometryBuffer(geom,
-			RTC_BUFFER_TYPE_VERTEX,
-			0,
-			RTC_FORMAT_FLOAT3,
-			3 * sizeof(float),
-			verCount);
-
-		unsigned* indices = (unsigned*)rtcSetNewGeometryBuffer(geom,
-			RTC_BUFFER_TYPE_INDEX,
-			0,
-			RTC_FORMAT_UINT3,
-			3 * sizeof(unsigned),
-			triCount);
-
-		if (vertices && indices)
+	m_scene = NewScene();
+
+	// instances of the same geometry share one prototype scene, only the transform differs.
+	// in two level mode every mesh gets its own scene, so each of them is a separate BVH build
+	std::vector<const Mesh*> prototypeMeshes;
+	for (const Mesh* mesh : m_meshes)
+	{
+		if ((mesh->isInstance() || m_twoLevel) && m_prototypes.emplace(mesh->getData().get(), nullptr).second)
+			prototypeMeshes.push_back(mesh);
+	}
+
+	// commit the prototypes concurrently. embree runs its own build tasks in the calling
+	// TBB arena, so the nested builds share the worker threads instead of oversubscribing
+	tbb::parallel_for(size_t(0), prototypeMeshes.size(), [&](size_t j) {
+		const Mesh* mesh = prototypeMeshes[j];
+		RTCScene prototype = NewScene();
+		RTCGeometry prototypeGeom = NewTriangleGeometry(mesh);
+		rtcAttachGeometry(prototype, prototypeGeom);
+		rtcReleaseGeometry(prototypeGeom);
+		rtcCommitScene(prototype);
+		// the map itself isn't modified here, every task writes a different entry
+		m_prototypes.find(mesh->getData().get())->second = prototype;
+	});
+
+	// the top level geometries are independent as well, geometry i belongs to m_meshes[i]
+	std::vector<RTCGeometry> geoms(m_meshes.size());
+	tbb::parallel_for(size_t(0), m_meshes.size(), [&](size_t i) {
+		const Mesh* mesh = m_meshes[i];
+		auto prototype = m_prototypes.find(mesh->getData().get());
+		if (prototype == m_prototypes.end())
 		{
-			// load vertices data
-			for (int j = 0; j < verCount; j++)
-			{
-				vertices[3 * j] = m_meshes[i]->getVertexPositions()(0, j);
-				vertices[3 * j + 1] = m_meshes[i]->getVertexPositions()(1, j);
-				vertices[3 * j + 2] = m_meshes[i]->getVertexPositions()(2, j);
-			}
-			// load indices data
-			for (int j = 0; j < triCount; j++)
-			{
-				indices[3 * j] = m_meshes[i]->getIndices()(0, j);
-				indices[3 * j + 1] = m_meshes[i]->getIndices()(1, j);
-				indices[3 * j + 2] = m_meshes[i]->getIndices()(2, j);
-			}
+			geoms[i] = NewTriangleGeometry(mesh);
+			return;
 		}
+		RTCGeometry geom = rtcNewGeometry(m_device, RTC_GEOMETRY_TYPE_INSTANCE);
+		rtcSetGeometryInstancedScene(geom, prototype->second);
+		// identity for meshes that aren't instances
+		rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR,
+			mesh->getToWorld().getMatrix().data());
 		rtcCommitGeometry(geom);
-		rtcAttachGeometry(m_scene, geom);
-		rtcReleaseGeometry(geom);
+		geoms[i] = geom;
+	});
+
+	// attaching modifies the scene, so that part stays serial
+	for (uint32_t i = 0; i < m_meshes.size(); i++)
+	{
+		rtcAttachGeometryByID(m_scene, geoms[i], i);
+		rtcReleaseGeometry(geoms[i]);
 	}
 	rtcCommitScene(m_scene);
 }
 
+void EmAccel::ReleaseScene()
+{
+	if (m_scene)
+		rtcReleaseScene(m_scene);
+	for (auto& prototype : m_prototypes)
+		rtcReleaseScene(prototype.second);
+	m_scene = nullptr;
+	m_prototypes.clear();
+}
+
+EmAccel::EmAccel(const PropertyList& props)
+{
+	std::string quality = props.getString("buildQuality", "medium");
+	if (quality == "low")
+		m_buildQuality = RTC_BUILD_QUALITY_LOW;
+	else if (quality == "medium")
+		m_buildQuality = RTC_BUILD_QUALITY_MEDIUM;
+	else if (quality == "high")
+		m_buildQuality = RTC_BUILD_QUALITY_HIGH;
+	else
+		throw NoriException("EmAccel: unknown build quality \"%s\" (expected low, medium or high)", quality);
+
+	if (props.getBoolean("compact", false))
+		m_sceneFlags = m_sceneFlags | RTC_SCENE_FLAG_COMPACT;
+	if (props.getBoolean("robust", false))
+		m_sceneFlags = m_sceneFlags | RTC_SCENE_FLAG_ROBUST;
+	m_twoLevel = props.getBoolean("twoLevel", false);
+
+	// device configuration string, e.g. "threads=8,isa=avx2,hugepages=1"
+	std::vector<std::string> config;
+	// embree builds without TBB tasking spawn their own threads, keep them within the pool size
+	int threads = props.getInteger("threads", getThreadCount());
+	if (threads > 0)
+		config.push_back(tfm::format("threads=%i", threads));
+	std::string isa = props.getString("isa", "");
+	if (!isa.empty())
+		config.push_back("isa=" + isa);
+	if (props.getBoolean("hugepages", false))
+		config.push_back("hugepages=1");
+	std::string extra = props.getString("config", "");
+	if (!extra.empty())
+		config.push_back(extra);
+	for (size_t i = 0; i < config.size(); i++)
+		m_deviceConfig += (i > 0 ? "," : "") + config[i];
+}
+
+EmAccel::~EmAccel()
+{
+	ReleaseScene();
+	if (!m_device)
+		return;
 
+	std::lock_guard<std::mutex> lock(s_deviceMutex);
+	SharedDevice* shared = s_devices[m_deviceConfig];
+	if (--shared->refCount == 0)
+	{
+		rtcReleaseDevice(shared->device);
+		s_devices.erase(m_deviceConfig);
+		delete shared;
+	}
+}
 
-EmAccel::EmAccel(std::vector<Mesh*> meshes)
+void EmAccel::build()
 {
-	m_meshes = meshes;
-	InitializeDevice();
+	if (m_meshes.empty())
+		return;
+
+	cout << "Building Embree BVH .. ";
+	cout.flush();
+	Timer timer;
+
+	if (!m_device)
+		InitializeDevice();
+	ReleaseScene();
+
+	// the memory monitor counts all allocations of the device, so take the difference
+	SharedDevice* shared;
+	{
+		std::lock_guard<std::mutex> lock(s_deviceMutex);
+		shared = s_devices[m_deviceConfig];
+	}
+	ssize_t bytesBefore = shared->bytes;
 	InitializeScene();
+	m_memoryUsage = (size_t)std::max<ssize_t>(0, shared->bytes - bytesBefore);
+	m_buildTime = timer.elapsed();
+
+	cout << "done. (took " << timeString(m_buildTime) << " and "
+		<< memString(m_memoryUsage) << ")" << endl;
 }
 
-bool EmAccel::RayIntersect(Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& idx)
+std::string EmAccel::toString() const
 {
+	auto qualityName = [](RTCBuildQuality quality) {
+		switch (quality)
+		{
+		case RTC_BUILD_QUALITY_LOW: return "low";
+		case RTC_BUILD_QUALITY_HIGH: return "high";
+		default: return "medium";
+		}
+	};
+	return tfm::format(
+		"EmAccel[\n"
+		"  buildQuality = %s,\n"
+		"  compact = %s,\n"
+		"  robust = %s,\n"
+		"  twoLevel = %s,\n"
+		"  device = \"%s\"\n"
+		"]",
+		qualityName(m_buildQuality),
+		(m_sceneFlags & RTC_SCENE_FLAG_COMPACT) ? "true" : "false",
+		(m_sceneFlags & RTC_SCENE_FLAG_ROBUST) ? "true" : "false",
+		m_twoLevel ? "true" : "false",
+		m_deviceConfig);
+}
+
+bool EmAccel::traceRay(Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& idx) const
+{
+	if (!m_scene)
+		return false;
+
 	struct RTCRayHit rayhit;
 	rayhit.ray.org_x = ray.o[0];
 	rayhit.ray.org_y = ray.o[1];
@@ -98,16 +284,147 @@ bool EmAccel::RayIntersect(Ray3f& ray, Intersection& its, bool shadowRay, uint32
 	rtcIntersect1(m_scene, &rayhit);
 	if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
 		return false;
-	// update its.uv, its.mesh, idx, 
-	float u, v, t;
-	if (m_meshes[rayhit.hit.geomID]->rayIntersect(rayhit.hit.primID, ray, u, v, t));
+	// embree reports the barycentrics and distance of the closest hit, no need to intersect the triangle again
+	its.bary = Point2f(rayhit.hit.u, rayhit.hit.v);
+	its.t = ray.maxt = rayhit.ray.tfar;
+	// for instances, the top level geometry is the instance and geomID refers to the prototype
+	unsigned meshID = rayhit.hit.instID[0] != RTC_INVALID_GEOMETRY_ID ? rayhit.hit.instID[0] : rayhit.hit.geomID;
+	its.mesh = m_meshes[meshID];
+	idx = rayhit.hit.primID;
+	return true;
+}
+
+// query context of traceOccluded, embree hands it back to the filter function
+struct OcclusionContext
+{
+	RTCRayQueryContext context; // must be the first member
+	const OcclusionFilter* filter;
+	const std::vector<Mesh*>* meshes;
+};
+
+static void OcclusionFilterFunction(const RTCFilterFunctionNArguments* args)
+{
+	const OcclusionContext* context = reinterpret_cast<const OcclusionContext*>(args->context);
+	for (unsigned i = 0; i < args->N; i++)
+	{
+		if (args->valid[i] == 0)
+			continue;
+		unsigned instID = RTCHitN_instID(args->hit, args->N, i, 0);
+		unsigned meshID = instID != RTC_INVALID_GEOMETRY_ID ? instID : RTCHitN_geomID(args->hit, args->N, i);
+		// rejecting the hit lets embree continue the traversal
+		if (context->filter->ignores((*context->meshes)[meshID], RTCHitN_primID(args->hit, args->N, i)))
+			args->valid[i] = 0;
+	}
+}
+
+bool EmAccel::traceOccluded(const Ray3f& ray, const OcclusionFilter& filter) const
+{
+	if (!m_scene)
+		return false;
+
+	RTCRay rtcRay;
+	rtcRay.org_x = ray.o[0];
+	rtcRay.org_y = ray.o[1];
+	rtcRay.org_z = ray.o[2];
+	rtcRay.dir_x = ray.d[0];
+	rtcRay.dir_y = ray.d[1];
+	rtcRay.dir_z = ray.d[2];
+	rtcRay.tnear = ray.mint;
+	rtcRay.tfar = ray.maxt;
+	rtcRay.mask = -1;
+	rtcRay.flags = 0;
+
+	OcclusionContext context;
+	rtcInitRayQueryContext(&context.context);
+	context.filter = &filter;
+	context.meshes = &m_meshes;
+
+	RTCOccludedArguments args;
+	rtcInitOccludedArguments(&args);
+	args.context = &context.context;
+	args.filter = OcclusionFilterFunction;
+	args.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+
+	// embree sets tfar to -inf if the ray is occluded
+	rtcOccluded1(m_scene, &rtcRay, &args);
+	return rtcRay.tfar < 0;
+}
+
+void EmAccel::traceRays(const RayBatch& rays, HitBatch& hits, bool shadowRay) const
+{
+	size_t n = rays.size();
+	hits.resize(n);
+	if (!m_scene)
+	{
+		std::fill(hits.hit.begin(), hits.hit.end(), 0);
+		return;
+	}
+
+	RTCIntersectArguments intersectArgs;
+	rtcInitIntersectArguments(&intersectArgs);
+	RTCOccludedArguments occludedArgs;
+	rtcInitOccludedArguments(&occludedArgs);
+	if (rays.coherent)
+	{
+		intersectArgs.flags = RTC_RAY_QUERY_FLAG_COHERENT;
+		occludedArgs.flags = RTC_RAY_QUERY_FLAG_COHERENT;
+	}
+
+	// trace in packets of PacketSize rays, the tail packet is masked by valid
+	for (size_t begin = 0; begin < n; begin += PacketSize)
 	{
-		its.uv = Point2f(u, v);
-		its.mesh = m_meshes[rayhit.hit.geomID];
-		idx = rayhit.hit.primID;
-		return true;
+		int count = (int)std::min<size_t>(PacketSize, n - begin);
+		alignas(32) int valid[PacketSize];
+		RTCRayHit8 rayhit;
+		for (int k = 0; k < PacketSize; k++)
+		{
+			valid[k] = k < count ? -1 : 0;
+			if (k >= count)
+				continue;
+			const Ray3f& ray = rays.rays[begin + k];
+			rayhit.ray.org_x[k] = ray.o[0];
+			rayhit.ray.org_y[k] = ray.o[1];
+			rayhit.ray.org_z[k] = ray.o[2];
+			rayhit.ray.dir_x[k] = ray.d[0];
+			rayhit.ray.dir_y[k] = ray.d[1];
+			rayhit.ray.dir_z[k] = ray.d[2];
+			rayhit.ray.tnear[k] = ray.mint;
+			rayhit.ray.tfar[k] = ray.maxt;
+			rayhit.ray.time[k] = 0.f;
+			rayhit.ray.mask[k] = -1;
+			rayhit.ray.flags[k] = 0;
+			rayhit.hit.geomID[k] = RTC_INVALID_GEOMETRY_ID;
+			rayhit.hit.instID[0][k] = RTC_INVALID_GEOMETRY_ID;
+		}
+
+		// shadow rays, embree sets tfar to -inf for blocked rays
+		if (shadowRay)
+		{
+			rtcOccluded8(valid, m_scene, &rayhit.ray, &occludedArgs);
+			for (int k = 0; k < count; k++)
+				hits.hit[begin + k] = rayhit.ray.tfar[k] < 0.f;
+			continue;
+		}
+
+		rtcIntersect8(valid, m_scene, &rayhit, &intersectArgs);
+		for (int k = 0; k < count; k++)
+		{
+			Intersection& its = hits.its[begin + k];
+			unsigned geomID = rayhit.hit.geomID[k];
+			hits.hit[begin + k] = geomID != RTC_INVALID_GEOMETRY_ID;
+			if (geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				its.mesh = nullptr;
+				continue;
+			}
+			its.bary = Point2f(rayhit.hit.u[k], rayhit.hit.v[k]);
+			its.t = rayhit.ray.tfar[k];
+			unsigned instID = rayhit.hit.instID[0][k];
+			its.mesh = m_meshes[instID != RTC_INVALID_GEOMETRY_ID ? instID : geomID];
+			its.primIdx = rayhit.hit.primID[k];
+		}
 	}
-	return false;
 }
 
+NORI_REGISTER_CLASS(EmAccel, "embree");
 NORI_NAMESPACE_END
\ No newline at end of file
@@ -118,8 +118,9 @@ NoriScreen::NoriScreen(const ImageBlock &block)
 
 
 void NoriScreen::draw_contents() {
-    // Reload the partially rendered image onto the GPU
-    m_block.lock();
+    // Reload the partially rendered image onto the GPU. The copy only locks
+    // one stripe of rows at a time, so rendering threads can keep merging
+    m_block.snapshot(m_pixels);
     const Vector2i &size = m_block.getSize();
     m_shader->set_uniform("scale", m_scale);
     m_renderPass->resize(framebuffer_size());
@@ -127,14 +128,13 @@ void NoriScreen::draw_contents() {
     m_renderPass->set_viewport(nanogui::Vector2i(0, 0),
                                nanogui::Vector2i(m_pixel_ratio * size[0],
                                                  m_pixel_ratio * size[1]));
-    m_texture->upload((uint8_t *) m_block.data());
+    m_texture->upload((uint8_t *) m_pixels.data());
     m_shader->set_texture("source", m_texture);
     m_shader->begin();
     m_shader->draw_array(nanogui::Shader::PrimitiveType::Triangle, 0, 6, true);
     m_shader->end();
     m_renderPass->set_viewport(nanogui::Vector2i(0, 0), framebuffer_size());
     m_renderPass->end();
-    m_block.unlock();
 }
 
 NORI_NAMESPACE_END
@@ -35,8 +35,8 @@ public:
 
     void prepare(const ImageBlock &block) {
         m_random.seed(
-            block.getOffset().x(),
-            block.getOffset().y()
+            block.getOffset().x() + ((uint64_t) m_pass << 32),
+            block.getOffset().y() + ((uint64_t) m_stream << 32)
         );
     }
 
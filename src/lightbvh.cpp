@@ -0,0 +1,329 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/lightbvh.h>
+#include <nori/emitter.h>
+#include <nori/timer.h>
+#include <Eigen/Geometry>
+
+/* Number of buckets used to evaluate the split cost */
+#define LIGHTBVH_BUCKETS 12
+
+/* Below this depth, lights are split at the median (the bit
+   trails that identify the path to a light have 64 bits) */
+#define LIGHTBVH_MEDIAN_DEPTH 32
+
+/* Marks lights without power, which aren't part of the hierarchy */
+#define LIGHTBVH_NO_TRAIL 0xFFFFFFFFFFFFFFFFull
+
+NORI_NAMESPACE_BEGIN
+
+static inline float safeSqrt(float value) { return std::sqrt(std::max(value, 0.f)); }
+static inline float safeAcos(float value) { return std::acos(clamp(value, -1.f, 1.f)); }
+
+/// cos(max(0, a - b)) given the sines and cosines of a and b
+static inline float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1.f : cosA * cosB + sinA * sinB;
+}
+
+/// sin(max(0, a - b)) given the sines and cosines of a and b
+static inline float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0.f : sinA * cosB - cosA * sinB;
+}
+
+float LightBVH::LightBounds::importance(const Point3f &p, const Normal3f &n) const {
+    if (phi == 0)
+        return 0.f;
+
+    /* Distance to the center, clamped to avoid a singularity inside of the box */
+    Point3f pc = bbox.getCenter();
+    Vector3f d = p - pc;
+    float radius = 0.5f * bbox.getExtents().norm();
+    float dist2 = std::max(d.squaredNorm(), radius);
+    Vector3f wi = d.normalized();
+
+    /* Angle between the cone axis and the direction to the shading point */
+    float cosTheta_w = w.dot(wi), sinTheta_w = safeSqrt(1 - cosTheta_w * cosTheta_w);
+
+    /* Angle subtended by the bounding sphere of the box */
+    float cosTheta_b = -1.f;
+    if (d.squaredNorm() > radius * radius)
+        cosTheta_b = safeSqrt(1 - radius * radius / d.squaredNorm());
+    float sinTheta_b = safeSqrt(1 - cosTheta_b * cosTheta_b);
+
+    /* Smallest angle between the shading point and any emission direction */
+    float sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+    float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float cosThetap = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosThetap <= cosTheta_e)
+        return 0.f;
+
+    float result = phi * cosThetap / dist2;
+
+    /* Account for the cosine at the shading point */
+    if (!n.isZero()) {
+        float cosTheta_i = std::abs(wi.dot(n)), sinTheta_i = safeSqrt(1 - cosTheta_i * cosTheta_i);
+        result *= cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+    }
+    return std::max(result, 0.f);
+}
+
+LightBVH::LightBounds LightBVH::LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+    if (a.phi == 0)
+        return b;
+    if (b.phi == 0)
+        return a;
+
+    LightBounds result;
+    result.bbox = a.bbox;
+    result.bbox.expandBy(b.bbox);
+    result.phi = a.phi + b.phi;
+    result.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+
+    /* Smallest cone that contains both normal cones */
+    float theta_a = safeAcos(a.cosTheta_o), theta_b = safeAcos(b.cosTheta_o),
+          theta_d = safeAcos(a.w.dot(b.w));
+    if (std::min(theta_d + theta_b, (float) M_PI) <= theta_a) {
+        result.w = a.w;
+        result.cosTheta_o = a.cosTheta_o;
+    } else if (std::min(theta_d + theta_a, (float) M_PI) <= theta_b) {
+        result.w = b.w;
+        result.cosTheta_o = b.cosTheta_o;
+    } else {
+        float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+        Vector3f axis = a.w.cross(b.w);
+        if (theta_o >= M_PI || axis.squaredNorm() == 0) {
+            /* The cone covers all directions */
+            result.w = a.w;
+            result.cosTheta_o = -1.f;
+        } else {
+            result.w = Eigen::AngleAxisf(theta_o - theta_a, axis.normalized()) * a.w;
+            result.cosTheta_o = std::cos(theta_o);
+        }
+    }
+    return result;
+}
+
+/// Surface area heuristic for lights, which also accounts for the spread of the emission
+static float evaluateCost(float phi, float cosTheta_o, float cosTheta_e, float area, float extentRatio) {
+    float theta_o = safeAcos(cosTheta_o), theta_e = safeAcos(cosTheta_e);
+    float theta_w = std::min(theta_o + theta_e, (float) M_PI);
+    float sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+    float M_omega = 2 * M_PI * (1 - cosTheta_o) +
+        0.5f * M_PI * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+                       2 * theta_o * sinTheta_o + cosTheta_o);
+    return phi * M_omega * extentRatio * area;
+}
+
+void LightBVH::build(const std::vector<Mesh *> &emitters) {
+    m_nodes.clear();
+    m_lights.clear();
+    m_trails.clear();
+    m_meshOffset.clear();
+
+    std::vector<BuildLight> buildLights;
+    for (const Mesh *mesh : emitters) {
+        m_meshOffset[mesh] = (uint32_t) m_lights.size();
+        float luminance = mesh->getEmitter()->sample().getLuminance();
+        bool hasNormals = mesh->getVertexNormals().size() > 0;
+        const MatrixXuMap &F = mesh->getIndices();
+
+        for (uint32_t f = 0; f < mesh->getTriangleCount(); ++f) {
+            float area = mesh->surfaceArea(f);
+            uint32_t index = (uint32_t) m_lights.size();
+            m_lights.push_back(Light { mesh, f, area });
+            if (area == 0 || luminance <= 0)
+                continue;
+
+            /* Emission happens on the side of the shading normals */
+            BuildLight bl;
+            bl.light = index;
+            bl.bounds.bbox = mesh->getBoundingBox(f);
+            bl.bounds.phi = luminance * area;
+            bl.bounds.w = mesh->getSurfaceNormal(f);
+            bl.bounds.cosTheta_e = 0.f;
+            if (hasNormals) {
+                Normal3f n[3];
+                for (int i = 0; i < 3; ++i)
+                    n[i] = mesh->getVertexNormal(F(i, f));
+                if (bl.bounds.w.dot(n[0] + n[1] + n[2]) < 0)
+                    bl.bounds.w = -bl.bounds.w;
+                for (int i = 0; i < 3; ++i)
+                    bl.bounds.cosTheta_o = std::min(bl.bounds.cosTheta_o, bl.bounds.w.dot(n[i]));
+                bl.bounds.cosTheta_o = clamp(bl.bounds.cosTheta_o, -1.f, 1.f);
+            }
+            buildLights.push_back(bl);
+        }
+    }
+
+    m_trails.resize(m_lights.size(), LIGHTBVH_NO_TRAIL);
+    if (buildLights.empty())
+        return;
+
+    cout << "Building light hierarchy (" << buildLights.size() << " triangles) .. ";
+    cout.flush();
+    Timer timer;
+
+    m_nodes.reserve(2 * buildLights.size() - 1);
+    buildRecursive(buildLights.data(), 0, (uint32_t) buildLights.size(), 0, 0);
+
+    cout << "done. (" << m_nodes.size() << " nodes, took " << timer.elapsedString() << ")" << endl;
+}
+
+uint32_t LightBVH::buildRecursive(BuildLight *lights, uint32_t start, uint32_t end,
+                                  uint64_t bitTrail, int depth) {
+    uint32_t index = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+
+    if (end - start == 1) {
+        m_nodes[index] = Node { lights[start].bounds, lights[start].light, true };
+        m_trails[lights[start].light] = bitTrail;
+        return index;
+    }
+
+    BoundingBox3f bounds, centroidBounds;
+    for (uint32_t i = start; i < end; ++i) {
+        bounds.expandBy(lights[i].bounds.bbox);
+        centroidBounds.expandBy(lights[i].bounds.bbox.getCenter());
+    }
+
+    /* Find the bucket boundary with the lowest cost along any axis */
+    float minCost = std::numeric_limits<float>::infinity();
+    int minBucket = -1, minDim = -1;
+    Vector3f extents = bounds.getExtents();
+    for (int dim = 0; dim < 3 && depth < LIGHTBVH_MEDIAN_DEPTH; ++dim) {
+        float minC = centroidBounds.min[dim], extent = centroidBounds.max[dim] - minC;
+        if (extent <= 0)
+            continue;
+
+        LightBounds buckets[LIGHTBVH_BUCKETS];
+        for (uint32_t i = start; i < end; ++i) {
+            int b = (int) (LIGHTBVH_BUCKETS * (lights[i].bounds.bbox.getCenter()[dim] - minC) / extent);
+            b = std::min(b, LIGHTBVH_BUCKETS - 1);
+            buckets[b] = LightBounds::merge(buckets[b], lights[i].bounds);
+        }
+
+        auto cost = [&](const LightBounds &b) {
+            return b.phi == 0 ? 0.f : evaluateCost(b.phi, b.cosTheta_o, b.cosTheta_e,
+                b.bbox.getSurfaceArea(), extents.maxCoeff() / extents[dim]);
+        };
+
+        for (int split = 0; split < LIGHTBVH_BUCKETS - 1; ++split) {
+            LightBounds b0, b1;
+            for (int i = 0; i <= split; ++i)
+                b0 = LightBounds::merge(b0, buckets[i]);
+            for (int i = split + 1; i < LIGHTBVH_BUCKETS; ++i)
+                b1 = LightBounds::merge(b1, buckets[i]);
+            float c = cost(b0) + cost(b1);
+            if (b0.phi > 0 && b1.phi > 0 && c < minCost) {
+                minCost = c;
+                minBucket = split;
+                minDim = dim;
+            }
+        }
+    }
+
+    uint32_t mid = start + (end - start) / 2;
+    if (minDim >= 0) {
+        float minC = centroidBounds.min[minDim],
+              extent = centroidBounds.max[minDim] - minC;
+        BuildLight *it = std::partition(lights + start, lights + end, [&](const BuildLight &l) {
+            int b = (int) (LIGHTBVH_BUCKETS * (l.bounds.bbox.getCenter()[minDim] - minC) / extent);
+            return std::min(b, LIGHTBVH_BUCKETS - 1) <= minBucket;
+        });
+        mid = (uint32_t) (it - lights);
+    }
+    if (minDim < 0 || mid == start || mid == end) {
+        mid = start + (end - start) / 2;
+        int axis = centroidBounds.getMajorAxis();
+        std::nth_element(lights + start, lights + mid, lights + end,
+            [axis](const BuildLight &a, const BuildLight &b) {
+                return a.bounds.bbox.getCenter()[axis] < b.bounds.bbox.getCenter()[axis];
+            });
+    }
+
+    /* The first child directly follows its parent */
+    uint32_t first = buildRecursive(lights, start, mid, bitTrail, depth + 1);
+    uint32_t second = buildRecursive(lights, mid, end, bitTrail | (1ull << depth), depth + 1);
+    /* Note: 'm_nodes' may have been reallocated by now */
+    m_nodes[index] = Node { LightBounds::merge(m_nodes[first].bounds, m_nodes[second].bounds), second, false };
+    return index;
+}
+
+bool LightBVH::sample(const Point3f &p, const Normal3f &n, float sample,
+                      const Point2f &sample2, EmitterSample &eRec) const {
+    if (m_nodes.empty())
+        return false;
+
+    uint32_t nodeIdx = 0;
+    float pmf = 1.f;
+    while (!m_nodes[nodeIdx].leaf) {
+        const Node &node = m_nodes[nodeIdx];
+        float ci0 = m_nodes[nodeIdx + 1].bounds.importance(p, n),
+              ci1 = m_nodes[node.index].bounds.importance(p, n);
+        if (ci0 == 0 && ci1 == 0)
+            return false;
+
+        /* Choose a child and rescale the sample for the next decision */
+        float p0 = ci0 / (ci0 + ci1);
+        if (sample < p0) {
+            sample = std::min(sample / p0, 1.f - Epsilon);
+            pmf *= p0;
+            nodeIdx = nodeIdx + 1;
+        } else {
+            sample = std::min((sample - p0) / (1 - p0), 1.f - Epsilon);
+            pmf *= 1 - p0;
+            nodeIdx = node.index;
+        }
+    }
+
+    /* Lights that can't contribute at all are never chosen */
+    if (nodeIdx == 0 && m_nodes[0].bounds.importance(p, n) == 0)
+        return false;
+
+    const Light &light = m_lights[m_nodes[nodeIdx].index];
+    eRec.mesh = light.mesh;
+    eRec.prim = light.prim;
+    eRec.p = light.mesh->sampleTriangle(light.prim, sample2, eRec.n);
+    eRec.pdf = pmf / light.area;
+    return true;
+}
+
+float LightBVH::pdf(const Point3f &p, const Normal3f &n, const Mesh *mesh, uint32_t prim) const {
+    auto it = m_meshOffset.find(mesh);
+    if (it == m_meshOffset.end())
+        return 0.f;
+    uint32_t index = it->second + prim;
+    uint64_t trail = m_trails[index];
+    if (trail == LIGHTBVH_NO_TRAIL)
+        return 0.f;
+
+    /* Retrace the decisions of sample() that lead to the light */
+    uint32_t nodeIdx = 0;
+    float pmf = 1.f;
+    while (!m_nodes[nodeIdx].leaf) {
+        const Node &node = m_nodes[nodeIdx];
+        float ci0 = m_nodes[nodeIdx + 1].bounds.importance(p, n),
+              ci1 = m_nodes[node.index].bounds.importance(p, n);
+        if (ci0 == 0 && ci1 == 0)
+            return 0.f;
+        if (trail & 1) {
+            pmf *= ci1 / (ci0 + ci1);
+            nodeIdx = node.index;
+        } else {
+            pmf *= ci0 / (ci0 + ci1);
+            nodeIdx = nodeIdx + 1;
+        }
+        trail >>= 1;
+    }
+
+    if (nodeIdx == 0 && m_nodes[0].bounds.importance(p, n) == 0)
+        return 0.f;
+    return pmf / m_lights[index].area;
+}
+
+NORI_NAMESPACE_END
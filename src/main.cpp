@@ -13,59 +13,196 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/threads.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
-#include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
+#include <algorithm>
+#include <cstring>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <fstream>
 #include <iostream>
 
 using namespace nori;
 
 static int threadCount = -1;
+static bool pinThreads = false;      /* Pin each render thread to one core */
+static int numaNode = -1;            /* Only use the cores of this NUMA node (-1: all) */
 static bool gui = true;
+static uint32_t sampleCount = 0;     /* Total samples per pixel (0: use the sampler's count) */
+static uint32_t passSampleCount = 0; /* Samples per pixel and pass (0: single pass) */
+static double timeLimit = 0;         /* Time budget in seconds (0: unlimited) */
+static float adaptiveThreshold = 0;  /* Target relative error of adaptive sampling (0: off) */
+static uint32_t adaptiveMinSamples = 8; /* Samples per pixel before the error is tested */
+static BlockGenerator::EOrder blockOrder = BlockGenerator::ESpiral;
+static bool adaptiveSchedule = false; /* Reorder and split blocks by their cost between passes */
+static double checkpointInterval = 0; /* Seconds between render checkpoints (0: off) */
+static bool resume = false;          /* Continue from the checkpoint of a previous run */
+static uint32_t maxPasses = 0;       /* Passes rendered before this run stops (0: unlimited) */
+static int firstTile = 0, lastTile = -1; /* Blocks [firstTile, lastTile) of the image (-1: all) */
+static uint32_t passSlot = 0, passSlotCount = 1; /* Only render the passes k with k % count == slot */
+static std::string batchName;        /* Job list of the batch mode ("-": stdin) */
+
+/// Progress of a render, which is stored in checkpoints
+struct RenderState {
+    uint32_t samplesDone = 0; ///< Samples per pixel rendered so far
+    uint32_t pass = 0;        ///< Index of the next pass
+    uint32_t splits = 0;      ///< Sample streams per block (0: not chosen yet)
+    double elapsed = 0;       ///< Time spent rendering in previous runs (ms)
+};
+
+static const char checkpointMagic[8] = { 'N', 'O', 'R', 'I', 'C', 'K', 'P', '2' };
+
+/**
+ * Write the accumulated image, the block layout and the adaptive sampling
+ * mask to a binary checkpoint. The samplers are seeded by pass and block,
+ * so they don't need to be saved.
+ */
+static void saveCheckpoint(const std::string &filename, const RenderState &state,
+                           const uint32_t settings[2], const ImageBlock &result,
+                           const BlockGenerator &blockGenerator, const std::vector<uint8_t> &active) {
+    /* Write to a temporary file first, so that an interruption
+       never leaves a truncated checkpoint behind */
+    std::string tmpName = filename + ".tmp";
+    {
+        std::ofstream os(tmpName, std::ios::binary);
+        os.write(checkpointMagic, sizeof(checkpointMagic));
+        os.write((const char *) settings, 2 * sizeof(uint32_t));
+        os.write((const char *) &state, sizeof(RenderState));
+        result.save(os);
+        blockGenerator.save(os);
+        uint64_t activeSize = active.size();
+        os.write((const char *) &activeSize, sizeof(activeSize));
+        os.write((const char *) active.data(), activeSize);
+        if (!os)
+            throw NoriException("Unable to write checkpoint \"%s\"!", tmpName);
+    }
+    if (!replaceFile(tmpName, filename))
+        throw NoriException("Unable to write checkpoint \"%s\"!", filename);
+}
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/// Restore a checkpoint (returns \c false if there is none)
+static bool loadCheckpoint(const std::string &filename, RenderState &state,
+                           const uint32_t settings[2], ImageBlock &result,
+                           BlockGenerator &blockGenerator, std::vector<uint8_t> &active) {
+    std::ifstream is(filename, std::ios::binary);
+    if (!is)
+        return false;
+
+    char magic[sizeof(checkpointMagic)];
+    uint32_t savedSettings[2];
+    is.read(magic, sizeof(magic));
+    is.read((char *) savedSettings, sizeof(savedSettings));
+    if (!is || memcmp(magic, checkpointMagic, sizeof(magic)) != 0)
+        throw NoriException("\"%s\" is not a valid checkpoint!", filename);
+    if (savedSettings[0] != settings[0] || savedSettings[1] != settings[1])
+        throw NoriException("Checkpoint \"%s\" was rendered with %i spp in passes of %i spp, "
+            "which doesn't match the current settings!", filename, savedSettings[0], savedSettings[1]);
+
+    is.read((char *) &state, sizeof(RenderState));
+    result.load(is);
+    blockGenerator.load(is);
+    uint64_t activeSize = 0;
+    is.read((char *) &activeSize, sizeof(activeSize));
+    if (activeSize != active.size())
+        throw NoriException("Checkpoint \"%s\" doesn't match the adaptive sampling settings!", filename);
+    is.read((char *) active.data(), activeSize);
+    if (!is)
+        throw NoriException("Checkpoint \"%s\" is truncated!", filename);
+    return true;
+}
+
+static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleCount,
+                        const std::vector<uint8_t> *active) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
+    int width = camera->getOutputSize().x();
 
     /* Clear the block contents */
     block.clear();
 
+    /* Skip pixels that adaptive sampling considers converged */
+    std::vector<Point2i> pixels;
+    pixels.reserve(size.x() * size.y());
+    for (int y=0; y<size.y(); ++y)
+        for (int x=0; x<size.x(); ++x)
+            if (!active || (*active)[(y + offset.y()) * width + x + offset.x()])
+                pixels.push_back(Point2i(x + offset.x(), y + offset.y()));
+
+    /* Integrators that trace many paths together render all samples at once */
+    if (integrator->renderPixels(scene, sampler, block, pixels, sampleCount))
+        return;
+
     /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
-            for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
-                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-                Point2f apertureSample = sampler->next2D();
+    for (const Point2i &pixel : pixels) {
+        for (uint32_t i=0; i<sampleCount; ++i) {
+            Point2f pixelSample = pixel.cast<float>() + sampler->next2D();
+            Point2f apertureSample = sampler->next2D();
 
-                /* Sample a ray from the camera */
-                Ray3f ray;
-                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+            /* Sample a ray from the camera */
+            Ray3f ray;
+            Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
 
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
+            /* Compute the incident radiance */
+            value *= integrator->Li(scene, sampler, ray);
 
-                /* Store in the image block */
-                block.put(pixelSample, value);
-            }
+            /* Store in the image block */
+            block.put(pixelSample, value);
         }
     }
 }
 
+/**
+ * Mark the pixels whose estimated relative error is still above the
+ * adaptive sampling threshold, and return how many of them there are
+ */
+static size_t updateActivePixels(const ImageBlock &result, std::vector<uint8_t> &active) {
+    Vector2i size = result.getSize();
+    std::atomic<size_t> activeCount(0);
+    tbb::parallel_for(tbb::blocked_range<int>(0, size.y()),
+        [&](const tbb::blocked_range<int> &range) {
+            size_t count = 0;
+            for (int y=range.begin(); y<range.end(); ++y) {
+                for (int x=0; x<size.x(); ++x) {
+                    uint8_t &flag = active[y * size.x() + x];
+                    flag = result.getRelativeError(Point2i(x, y)) > adaptiveThreshold;
+                    count += flag;
+                }
+            }
+            activeCount += count;
+        }
+    );
+    return activeCount;
+}
+
 static void render(Scene *scene, const std::string &filename) {
+    /* Determine the filename of the output bitmap */
+    std::string outputName = filename;
+    size_t lastdot = outputName.find_last_of(".");
+    if (lastdot != std::string::npos)
+        outputName.erase(lastdot, std::string::npos);
+
+    /* Parts of a frame rendered by separate processes are stored as
+       unnormalized partial images, which are combined by 'nori-merge' */
+    bool partial = lastTile >= 0 || passSlotCount > 1;
+    if (lastTile >= 0)
+        outputName += tfm::format("_tiles%i-%i", firstTile, lastTile);
+    if (passSlotCount > 1)
+        outputName += tfm::format("_pass%iof%i", passSlot, passSlotCount);
+
     const Camera *camera = scene->getCamera();
     Vector2i outputSize = camera->getOutputSize();
     scene->getIntegrator()->preprocess(scene);
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
-
     /* Allocate memory for the entire output image and clear it */
     ImageBlock result(outputSize, camera->getReconstructionFilter());
+    bool adaptive = adaptiveThreshold > 0;
+    result.setMomentsEnabled(adaptive);
     result.clear();
 
     /* Create a window that visualizes the partially rendered result */
@@ -75,49 +212,231 @@ static void render(Scene *scene, const std::string &filename) {
         screen = new NoriScreen(result);
     }
 
+    /* Progressive rendering splits the samples into passes that are
+       accumulated into 'result', which gives a usable image early on */
+    bool progressive = sampleCount > 0 || passSampleCount > 0 || timeLimit > 0 || adaptive ||
+        checkpointInterval > 0 || resume || maxPasses > 0 || passSlotCount > 1;
+    uint32_t totalSamples = sampleCount > 0 ? sampleCount :
+        (uint32_t) scene->getSampler()->getSampleCount();
+    uint32_t passSamples = !progressive ? totalSamples :
+        (passSampleCount > 0 ? std::min(passSampleCount, totalSamples) : 1);
+
+    /* By default, each of the processes sharing the passes renders one of them */
+    if (passSlotCount > 1) {
+        if (adaptive)
+            throw NoriException("Adaptive sampling can't be combined with --pass, since "
+                "the processes would not know about each other's samples!");
+        if (passSampleCount == 0)
+            passSamples = std::max(1u, (totalSamples + passSlotCount - 1) / passSlotCount);
+        uint32_t passCount = (totalSamples + passSamples - 1) / passSamples;
+        if (passSlot >= passCount && !(timeLimit > 0 && sampleCount == 0))
+            throw NoriException("--pass %i/%i: the image only has %i passes of %i spp!",
+                passSlot, passSlotCount, passCount, passSamples);
+    }
+
+    /* Create a block generator (i.e. a work scheduler) */
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE, blockOrder);
+    if (lastTile >= 0)
+        blockGenerator.setRange(firstTile, lastTile);
+
+    /* Adaptive sampling: pixels that still need samples */
+    std::vector<uint8_t> active;
+    size_t activeCount = (size_t) outputSize.x() * outputSize.y();
+    if (adaptive)
+        active.assign(activeCount, 1);
+
+    /* Continue from a checkpoint of an interrupted run, if requested */
+    RenderState state;
+    std::string checkpointName = outputName + ".ckpt";
+    const uint32_t settings[2] = { totalSamples, passSamples };
+    if (resume) {
+        if (loadCheckpoint(checkpointName, state, settings, result, blockGenerator, active)) {
+            if (adaptive)
+                activeCount = (size_t) std::count(active.begin(), active.end(), 1);
+            cout << "Resuming from \"" << checkpointName << "\" (" << state.samplesDone
+                 << " spp, " << timeString(state.elapsed) << ")" << endl;
+        } else {
+            cout << "No checkpoint \"" << checkpointName << "\" found, starting from scratch" << endl;
+        }
+    }
+
     /* Do the following in parallel and asynchronously */
-    std::thread render_thread([&] {
-        tbb::task_scheduler_init init(threadCount);
+    auto renderPasses = [&] {
+        int workerCount = getThreadCount();
 
         cout << "Rendering .. ";
         cout.flush();
-        Timer timer;
-
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
-
-        auto map = [&](const tbb::blocked_range<int> &range) {
-            /* Allocate memory for a small image block to be rendered
-               by the current thread */
-            ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                camera->getReconstructionFilter());
-
-            /* Create a clone of the sampler for the current thread */
-            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
-
-            for (int i=range.begin(); i<range.end(); ++i) {
-                /* Request an image block from the block generator */
-                blockGenerator.next(block);
-
-                /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
-
-                /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
+        Timer timer, checkpointTimer;
+
+        /* With a time limit and without an explicit sample count,
+           passes are rendered until the time is up */
+        bool unbounded = timeLimit > 0 && sampleCount == 0;
+        uint32_t &samplesDone = state.samplesDone, &pass = state.pass;
+        auto elapsed = [&] { return state.elapsed + timer.elapsed(); };
+        auto timeUp = [&] { return timeLimit > 0 && elapsed() >= timeLimit * 1000; };
+
+        /* Has this process rendered at least one pass? */
+        auto started = [&] { return pass > passSlot; };
+
+        /* With fewer blocks than threads (e.g. tiny test images), the samples
+           of each block are split across several threads. Each split uses its
+           own sample stream, so the count is fixed when the render starts and
+           kept when it is resumed (possibly with a different thread count) */
+        if (state.splits == 0) {
+            int blockCount = blockGenerator.getBlockCount();
+            state.splits = (uint32_t) std::max(1, (workerCount + blockCount - 1) / blockCount);
+        }
+        uint32_t passesRun = 0;
+
+        while (activeCount > 0 && (unbounded || samplesDone < totalSamples) && !(started() && timeUp()) &&
+               !(maxPasses > 0 && passesRun >= maxPasses)) {
+            uint32_t samples = unbounded ? passSamples :
+                std::min(passSamples, totalSamples - samplesDone);
+
+            /* Passes that belong to other processes only advance the
+               pass index, which determines how the samplers are seeded */
+            if (pass % passSlotCount != passSlot) {
+                samplesDone += samples;
+                ++pass;
+                continue;
+            }
 
-                /* The image block has been processed. Now add it to
-                   the "big" block that represents the entire image */
-                result.put(block);
+            blockGenerator.reset();
+            int blockCount = blockGenerator.getBlockCount();
+            uint32_t splits = std::min(samples, state.splits);
+            size_t slotCount = (size_t) blockCount * splits;
+            tbb::blocked_range<int> range(0, (int) slotCount);
+
+            /* Finished blocks are merged into 'result' in the order of their
+               indices rather than in the order they complete, so that the
+               floating point sums (and thus the image) don't depend on the
+               thread scheduling. This keeps resumed renders bit-identical */
+            std::vector<std::unique_ptr<ImageBlock>> finished(slotCount);
+            std::vector<uint8_t> ready(slotCount, 0);
+            size_t mergeCursor = 0;
+            std::mutex mergeMutex;
+            auto merge = [&](size_t slot, std::unique_ptr<ImageBlock> block) {
+                std::lock_guard<std::mutex> lock(mergeMutex);
+                finished[slot] = std::move(block);
+                ready[slot] = 1;
+                for (; mergeCursor < slotCount && ready[mergeCursor]; ++mergeCursor) {
+                    if (finished[mergeCursor]) {
+                        result.put(*finished[mergeCursor]);
+                        finished[mergeCursor].reset();
+                    }
+                }
+            };
+
+            auto map = [&](const tbb::blocked_range<int> &range) {
+                /* Create a clone of the sampler for the current thread */
+                std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+                sampler->setPass(pass);
+
+                for (int i=range.begin(); i<range.end(); ++i) {
+                    /* Allocate memory for a small image block, which is
+                       kept until all blocks before it have been merged */
+                    std::unique_ptr<ImageBlock> block(new ImageBlock(
+                        Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter()));
+                    block->setMomentsEnabled(adaptive);
+
+                    /* Request an image block from the block generator */
+                    int index;
+                    uint32_t split = 0, splitSamples = samples;
+                    if (splits == 1) {
+                        blockGenerator.next(*block, &index);
+                    } else {
+                        /* Each split renders its share of the samples
+                           using a separate (deterministic) sample stream */
+                        index = i / (int) splits;
+                        split = (uint32_t) i % splits;
+                        splitSamples = samples / splits + (split < samples % splits ? 1 : 0);
+                        blockGenerator.getBlock(index, *block);
+                    }
+                    size_t slot = (size_t) index * splits + split;
+
+                    /* Once the time is up, the remaining blocks of the last pass are
+                       skipped (all pixels have samples from the first pass) */
+                    if (started() && timeUp()) {
+                        merge(slot, nullptr);
+                        continue;
+                    }
+
+                    /* Inform the sampler about the block to be rendered */
+                    sampler->setStream(split);
+                    sampler->prepare(*block);
+
+                    /* Render all contained pixels (and measure how long that takes) */
+                    Timer blockTimer;
+                    renderBlock(scene, sampler.get(), *block, splitSamples,
+                        adaptive ? &active : nullptr);
+                    if (splits == 1)
+                        blockGenerator.setCost(index, (float) blockTimer.elapsed());
+
+                    /* The image block has been processed. Now add it to
+                       the "big" block that represents the entire image */
+                    merge(slot, std::move(block));
+                }
+            };
+
+            /// Default: parallel rendering
+            tbb::parallel_for(range, map);
+
+            /// (equivalent to the following single-threaded call)
+            // map(range);
+
+            samplesDone += samples;
+            ++pass;
+            ++passesRun;
+
+            /* Further passes only go to pixels that haven't converged yet */
+            if (adaptive && samplesDone >= adaptiveMinSamples)
+                activeCount = updateActivePixels(result, active);
+
+            if (progressive) {
+                cout << "\rRendering .. pass " << pass << " (" << samplesDone
+                     << " spp, " << timeString(elapsed());
+                if (adaptive)
+                    cout << ", " << tfm::format("%.1f", 100.0 * activeCount / active.size())
+                         << "% of pixels active";
+                cout << ")";
+                cout.flush();
             }
-        };
 
-        /// Default: parallel rendering
-        tbb::parallel_for(range, map);
+            /* Start the next pass with the blocks that were most expensive in
+               this one, and split those that would otherwise dominate its end.
+               The samplers are seeded by block, so this depends on timing and
+               makes the image differ between runs (hence it is opt-in) */
+            if (adaptiveSchedule && splits == 1)
+                blockGenerator.schedule(workerCount);
+
+            /* Passes are the unit of work that can be resumed */
+            if (checkpointInterval > 0 && checkpointTimer.elapsed() >= checkpointInterval * 1000) {
+                RenderState saved = state;
+                saved.elapsed = elapsed();
+                try {
+                    saveCheckpoint(checkpointName, saved, settings, result, blockGenerator, active);
+                } catch (const std::exception &e) {
+                    cerr << endl << "Warning: " << e.what() << endl;
+                }
+                checkpointTimer.reset();
+            }
+        }
 
-        /// (equivalent to the following single-threaded call)
-        // map(range);
+        /* The final state allows continuing e.g. with a larger time limit */
+        if (checkpointInterval > 0) {
+            state.elapsed = elapsed();
+            try {
+                saveCheckpoint(checkpointName, state, settings, result, blockGenerator, active);
+            } catch (const std::exception &e) {
+                cerr << endl << "Warning: " << e.what() << endl;
+            }
+        }
 
+        if (progressive)
+            cout << endl << "Rendering .. ";
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
-    });
+    };
+    std::thread render_thread([&] { runInThreadPool(renderPasses, true); });
 
     /* Enter the application main loop */
     if (gui)
@@ -131,16 +450,16 @@ static void render(Scene *scene, const std::string &filename) {
         nanogui::shutdown();
     }
 
+    /* Partial images keep the filter weights, so that they can be merged */
+    if (partial) {
+        result.saveEXR(outputName);
+        return;
+    }
+
     /* Now turn the rendered image block into
        a properly normalized bitmap */
     std::unique_ptr<Bitmap> bitmap(result.toBitmap());
 
-    /* Determine the filename of the output bitmap */
-    std::string outputName = filename;
-    size_t lastdot = outputName.find_last_of(".");
-    if (lastdot != std::string::npos)
-        outputName.erase(lastdot, std::string::npos);
-
     /* Save using the OpenEXR format */
     bitmap->saveEXR(outputName);
 
@@ -148,9 +467,96 @@ static void render(Scene *scene, const std::string &filename) {
     bitmap->savePNG(outputName);
 }
 
+/**
+ * Render a list of jobs using a scene that is only loaded (and whose
+ * acceleration data structure is only built) once. Each line of the job
+ * list has the form
+ *
+ *     <output> [camera=<camera.xml>] [sampler=<sampler.xml>] [spp=N]
+ *
+ * where the XML files contain a single <camera> or <sampler> element that
+ * replaces the one of the scene for this job. Empty lines and lines that
+ * start with '#' are ignored. Returns the number of jobs that failed.
+ */
+static int renderBatch(Scene *scene, const std::string &batchName) {
+    std::ifstream file;
+    if (batchName != "-") {
+        file.open(batchName);
+        if (!file)
+            throw NoriException("Unable to open the job list \"%s\"!", batchName);
+    }
+    std::istream &is = batchName == "-" ? std::cin : file;
+
+    int jobCount = 0, failureCount = 0;
+    std::string line;
+    for (int lineNumber = 1; std::getline(is, line); ++lineNumber) {
+        std::vector<std::string> tokens = tokenize(line, " \t\r");
+        if (tokens.empty() || tokens[0][0] == '#')
+            continue;
+        ++jobCount;
+
+        Camera *prevCamera = nullptr;
+        Sampler *prevSampler = nullptr;
+        uint32_t prevSampleCount = sampleCount;
+
+        try {
+            std::unique_ptr<Camera> camera;
+            std::unique_ptr<Sampler> sampler;
+            for (size_t i = 1; i < tokens.size(); ++i) {
+                size_t pos = tokens[i].find('=');
+                std::string key = tokens[i].substr(0, pos),
+                            value = pos == std::string::npos ? "" : tokens[i].substr(pos + 1);
+
+                if (key == "camera" || key == "sampler") {
+                    std::string path = getFileResolver()->resolve(value).str();
+                    std::unique_ptr<NoriObject> obj(loadFromXML(path));
+                    if (key == "camera" && obj->getClassType() == NoriObject::ECamera)
+                        camera.reset(static_cast<Camera *>(obj.release()));
+                    else if (key == "sampler" && obj->getClassType() == NoriObject::ESampler)
+                        sampler.reset(static_cast<Sampler *>(obj.release()));
+                    else
+                        throw NoriException("\"%s\" doesn't contain a <%s> element!", path, key);
+                } else if (key == "spp") {
+                    sampleCount = toUInt(value);
+                    if (sampleCount == 0)
+                        throw NoriException("\"spp\" expects a positive integer!");
+                } else {
+                    throw NoriException("Unknown job option \"%s\"!", tokens[i]);
+                }
+            }
+
+            cout << "Job " << jobCount << ": rendering \"" << tokens[0] << "\"" << endl;
+            if (camera)
+                prevCamera = scene->setCamera(camera.release());
+            if (sampler)
+                prevSampler = scene->setSampler(sampler.release());
+
+            render(scene, tokens[0]);
+        } catch (const std::exception &e) {
+            cerr << "Job " << jobCount << " (line " << lineNumber << ") failed: " << e.what() << endl;
+            ++failureCount;
+        }
+
+        /* Restore the scene for the next job */
+        if (prevCamera)
+            delete scene->setCamera(prevCamera);
+        if (prevSampler)
+            delete scene->setSampler(prevSampler);
+        sampleCount = prevSampleCount;
+    }
+
+    cout << "Batch finished: " << jobCount - failureCount << " of "
+         << jobCount << " jobs succeeded" << endl;
+    return failureCount;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N]" <<  endl;
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N] [--spp N]"
+                " [--pass-spp N] [--time-limit seconds] [--adaptive threshold] [--adaptive-min-spp N]"
+                " [--block-order spiral|hilbert|scanline] [--adaptive-schedule]"
+                " [--checkpoint seconds] [--resume] [--max-passes N] [--tiles a:b] [--pass k/N]"
+                " [--batch jobs.txt|-] [--pin-threads] [--numa-node N]" <<  endl;
         return -1;
     }
 
@@ -173,10 +579,138 @@ int main(int argc, char **argv) {
 
             continue;
         }
+        else if (token == "--pin-threads") {
+            pinThreads = true;
+            continue;
+        }
+        else if (token == "--numa-node") {
+            if (i+1 >= argc || atoi(argv[i+1]) < 0 || !isdigit(argv[i+1][0])) {
+                cerr << "\"--numa-node\" argument expects a non-negative integer following it." << endl;
+                return -1;
+            }
+            numaNode = atoi(argv[i+1]);
+            i++;
+            continue;
+        }
         else if (token == "--no-gui") {
             gui = false;
             continue;
         }
+        else if (token == "--spp" || token == "--pass-spp") {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            if (token == "--spp")
+                sampleCount = (uint32_t) atoi(argv[i+1]);
+            else
+                passSampleCount = (uint32_t) atoi(argv[i+1]);
+            i++;
+            continue;
+        }
+        else if (token == "--adaptive") {
+            if (i+1 >= argc || atof(argv[i+1]) <= 0) {
+                cerr << "\"--adaptive\" argument expects a positive relative error following it." << endl;
+                return -1;
+            }
+            adaptiveThreshold = (float) atof(argv[i+1]);
+            i++;
+            continue;
+        }
+        else if (token == "--adaptive-min-spp") {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 1) {
+                cerr << "\"--adaptive-min-spp\" argument expects an integer > 1 following it." << endl;
+                return -1;
+            }
+            adaptiveMinSamples = (uint32_t) atoi(argv[i+1]);
+            i++;
+            continue;
+        }
+        else if (token == "--checkpoint") {
+            if (i+1 >= argc || atof(argv[i+1]) < 0) {
+                cerr << "\"--checkpoint\" argument expects a number of seconds following it." << endl;
+                return -1;
+            }
+            /* A checkpoint is written after every pass if the interval is zero */
+            checkpointInterval = std::max(atof(argv[i+1]), 1e-3);
+            i++;
+            continue;
+        }
+        else if (token == "--tiles") {
+            int a, b;
+            if (i+1 >= argc || sscanf(argv[i+1], "%i:%i", &a, &b) != 2 || a < 0 || b <= a) {
+                cerr << "\"--tiles\" argument expects a block range a:b (with a < b) following it." << endl;
+                return -1;
+            }
+            firstTile = a;
+            lastTile = b;
+            i++;
+            continue;
+        }
+        else if (token == "--pass") {
+            int k, n;
+            if (i+1 >= argc || sscanf(argv[i+1], "%i/%i", &k, &n) != 2 || n <= 0 || k < 0 || k >= n) {
+                cerr << "\"--pass\" argument expects k/N (with 0 <= k < N) following it." << endl;
+                return -1;
+            }
+            passSlot = (uint32_t) k;
+            passSlotCount = (uint32_t) n;
+            i++;
+            continue;
+        }
+        else if (token == "--batch") {
+            if (i+1 >= argc) {
+                cerr << "\"--batch\" argument expects a job list (or - for stdin) following it." << endl;
+                return -1;
+            }
+            batchName = argv[i+1];
+            /* Jobs are rendered back to back without waiting for a window to close */
+            gui = false;
+            i++;
+            continue;
+        }
+        else if (token == "--resume") {
+            resume = true;
+            continue;
+        }
+        else if (token == "--max-passes") {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "\"--max-passes\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            /* Stop early (e.g. at the end of a time slot), leaving a checkpoint to resume from */
+            maxPasses = (uint32_t) atoi(argv[i+1]);
+            i++;
+            continue;
+        }
+        else if (token == "--adaptive-schedule" || token == "--static-schedule") {
+            /* The static schedule is the default (the flag is still accepted) */
+            adaptiveSchedule = token == "--adaptive-schedule";
+            continue;
+        }
+        else if (token == "--block-order") {
+            if (i+1 >= argc) {
+                cerr << "\"--block-order\" argument expects spiral, hilbert or scanline following it." << endl;
+                return -1;
+            }
+            try {
+                blockOrder = BlockGenerator::orderFromString(argv[i+1]);
+            } catch (const std::exception &e) {
+                cerr << e.what() << endl;
+                return -1;
+            }
+            i++;
+            continue;
+        }
+        else if (token == "--time-limit") {
+            if (i+1 >= argc || atof(argv[i+1]) <= 0) {
+                cerr << "\"--time-limit\" argument expects a positive number of seconds following it." << endl;
+                return -1;
+            }
+            timeLimit = atof(argv[i+1]);
+            i++;
+            continue;
+        }
 
         filesystem::path path(argv[i]);
 
@@ -232,13 +766,24 @@ int main(int argc, char **argv) {
         }
     }
     else { // sceneName != ""
-        if (threadCount < 0) {
-            threadCount = tbb::task_scheduler_init::automatic;
-        }
         try {
-            std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+            /* Scene loading, acceleration data structures and rendering
+               share one pool, so that they don't oversubscribe the cores */
+            initThreadPool(threadCount, pinThreads, numaNode);
+            cout << "Using " << getThreadCount() << " threads" << endl;
+
+            std::unique_ptr<NoriObject> root;
+            runInThreadPool([&] { root.reset(loadFromXML(sceneName)); });
+            if (batchName != "") {
+                if (root->getClassType() != NoriObject::EScene)
+                    throw NoriException("\"--batch\" requires a scene file!");
+                if (batchName != "-")
+                    getFileResolver()->prepend(filesystem::path(batchName).parent_path());
+                if (renderBatch(static_cast<Scene *>(root.get()), batchName) > 0)
+                    return -1;
+            }
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
+            else if (root->getClassType() == NoriObject::EScene)
                 render(static_cast<Scene *>(root.get()), sceneName);
         } catch (const std::exception &e) {
             cerr << e.what() << endl;
@@ -0,0 +1,55 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+/* =======================================================================
+     Combines partial renders (written using the --tiles and --pass
+     arguments of 'nori') into the final image.
+ * ======================================================================= */
+
+#include <nori/block.h>
+#include <nori/bitmap.h>
+#include <ImfInputFile.h>
+
+using namespace nori;
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "Syntax: " << argv[0] << " <output> <partial.exr> [<partial.exr> ...]" << endl;
+        return -1;
+    }
+
+    /* Determine the filename of the output bitmap */
+    std::string outputName = argv[1];
+    if (endsWith(toLower(outputName), ".exr") || endsWith(toLower(outputName), ".png"))
+        outputName.erase(outputName.size() - 4);
+
+    try {
+        /* All partials must have the size of the first one */
+        Imath::Box2i dw = Imf::InputFile(argv[2]).header().dataWindow();
+        Vector2i size(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1);
+
+        ImageBlock result(size, nullptr);
+        result.clear();
+        for (int i = 2; i < argc; ++i) {
+            cout << "Adding partial render \"" << argv[i] << "\"" << endl;
+            result.accumulateEXR(argv[i]);
+        }
+
+        /* Pixels without any samples point to a missing tile */
+        int64_t missing = (result.unaryExpr([](const Color4f &c) { return c.w(); }) == 0.f).count();
+        if (missing > 0)
+            cerr << "Warning: " << missing << " pixels didn't receive any samples!" << endl;
+
+        std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+        bitmap->saveEXR(outputName);
+        bitmap->savePNG(outputName);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -18,6 +18,7 @@ Mesh::Mesh() { }
 Mesh::~Mesh() {
     delete m_bsdf;
     delete m_emitter;
+    delete m_dpdf;
 }
 
 void Mesh::activate() {
@@ -29,7 +30,7 @@ void Mesh::activate() {
     // initialize the dpdf if the mesh is an emitter
     m_surface = 0.f;
     if (m_emitter) {
-        m_dpdf = new DiscretePDF();
+        m_dpdf = new AliasPDF();
         m_dpdf->reserve(getTriangleCount());
         for (uint32_t i = 0; i < getTriangleCount(); i++)
         {
@@ -41,24 +42,67 @@ void Mesh::activate() {
     }
 }
 
+MeshData::MeshData(uint32_t vertexCount, uint32_t triangleCount,
+                   bool hasNormals, bool hasTexCoords)
+    : vertexCount(vertexCount), triangleCount(triangleCount) {
+    V.resize(3 * (size_t) vertexCount + 1);
+    F.resize(3 * (size_t) triangleCount + 1);
+    if (hasNormals)
+        N.resize(3 * (size_t) vertexCount + 1);
+    if (hasTexCoords)
+        UV.resize(2 * (size_t) vertexCount + 1);
+}
+
+void Mesh::setData(const std::shared_ptr<MeshData> &data, const Transform &toWorld) {
+    m_data = data;
+    m_toWorld = toWorld;
+    m_instance = !toWorld.getMatrix().isIdentity();
+
+    uint32_t nV = data->vertexCount, nF = data->triangleCount;
+    new (&m_V) MatrixXfMap(data->V.data(), 3, nV);
+    new (&m_F) MatrixXuMap(data->F.data(), 3, nF);
+    new (&m_N) MatrixXfMap(data->N.data(), 3, data->N.empty() ? 0 : nV);
+    new (&m_UV) MatrixXfMap(data->UV.data(), 2, data->UV.empty() ? 0 : nV);
+}
+
+void Mesh::bakeTransform() {
+    if (!m_instance)
+        return;
+
+    /* Transform the buffers in place when no other mesh references them,
+       and only copy the geometry when it is shared */
+    std::shared_ptr<MeshData> baked = m_data.use_count() == 1
+        ? m_data : std::make_shared<MeshData>(*m_data);
+    MatrixXfMap V(baked->V.data(), 3, baked->vertexCount);
+    for (uint32_t i = 0; i < baked->vertexCount; ++i)
+        V.col(i) = getVertexPosition(i);
+    if (m_N.size() > 0) {
+        MatrixXfMap N(baked->N.data(), 3, baked->vertexCount);
+        for (uint32_t i = 0; i < baked->vertexCount; ++i)
+            N.col(i) = getVertexNormal(i);
+    }
+    setData(baked);
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = getVertexPosition(i0), p1 = getVertexPosition(i1), p2 = getVertexPosition(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 Vector3f Mesh::getSurfaceNormal(uint32_t index) const {
-    Vector3f v1 = m_V.col(m_F(1, index)) - m_V.col(m_F(0, index));
-    Vector3f v2 = m_V.col(m_F(2, index)) - m_V.col(m_F(0, index));
+    Point3f p0 = getVertexPosition(m_F(0, index));
+    Vector3f v1 = getVertexPosition(m_F(1, index)) - p0;
+    Vector3f v2 = getVertexPosition(m_F(2, index)) - p0;
     Vector3f normal = v1.cross(v2).normalized();
     return normal;
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = getVertexPosition(i0), p1 = getVertexPosition(i1), p2 = getVertexPosition(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -96,17 +140,17 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    BoundingBox3f result(getVertexPosition(m_F(0, index)));
+    result.expandBy(getVertexPosition(m_F(1, index)));
+    result.expandBy(getVertexPosition(m_F(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (getVertexPosition(m_F(0, index)) +
+         getVertexPosition(m_F(1, index)) +
+         getVertexPosition(m_F(2, index)));
 }
 
 void Mesh::addChild(NoriObject *obj) {
@@ -139,17 +183,75 @@ std::string Mesh::toString() const {
         "  name = \"%s\",\n"
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
+        "  instance = %s,\n"
         "  bsdf = %s,\n"
         "  emitter = %s\n"
         "]",
         m_name,
         m_V.cols(),
         m_F.cols(),
+        m_instance ? "true" : "false",
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
 }
 
+void Intersection::resolve() {
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+
+    /* Find the barycentric coordinates */
+    Vector3f b;
+    b << 1-bary.sum(), bary;
+
+    /* References to all relevant mesh buffers */
+    const MatrixXfMap &N  = mesh->getVertexNormals();
+    const MatrixXfMap &UV = mesh->getVertexTexCoords();
+    const MatrixXuMap &F  = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, primIdx), idx1 = F(1, primIdx), idx2 = F(2, primIdx);
+
+    /* World space positions (the buffers of instances are in object space) */
+    Point3f p0 = mesh->getVertexPosition(idx0),
+            p1 = mesh->getVertexPosition(idx1),
+            p2 = mesh->getVertexPosition(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    p = b.x() * p0 + b.y() * p1 + b.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        uv = b.x() * UV.col(idx0) +
+            b.y() * UV.col(idx1) +
+            b.z() * UV.col(idx2);
+    else
+        uv = bary;
+
+    /* Compute the geometry frame */
+    geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        shFrame = Frame(
+            (b.x() * mesh->getVertexNormal(idx0) +
+             b.y() * mesh->getVertexNormal(idx1) +
+             b.z() * mesh->getVertexNormal(idx2)).normalized());
+    } else {
+        shFrame = geoFrame;
+    }
+}
+
 std::string Intersection::toString() const {
     if (!mesh)
         return "Intersection[invalid]";
@@ -177,20 +279,26 @@ Point3f Mesh::sampleUniformPts(Sampler* sampler, Vector3f& normal, float& pdf, u
     float xi0 = sampler->next1D(), xi1 = sampler->next1D(), xi2 = sampler->next1D();
     //std::cout << xi0 << ' ' << xi1 << ' ' << xi2 << std::endl;
     index = m_dpdf->sample(xi0);
-    // uniform in triangle
-    float alpha = 1 - sqrt(xi1);
-    float beta = xi2 * sqrt(xi1);
-    Point3f p0 = m_V.col(m_F(0, index)), p1 = m_V.col(m_F(1, index)), p2 = m_V.col(m_F(2, index));
+    Normal3f n;
+    Point3f pos = sampleTriangle(index, Point2f(xi1, xi2), n);
+    normal = n;
+    pdf = 1 / m_surface;
+    return pos;
+}
+
+Point3f Mesh::sampleTriangle(uint32_t index, const Point2f &sample, Normal3f &normal) const {
+    /* Uniform in the triangle */
+    float alpha = 1 - std::sqrt(sample.x());
+    float beta = sample.y() * std::sqrt(sample.x());
+    Point3f p0 = getVertexPosition(m_F(0, index)), p1 = getVertexPosition(m_F(1, index)), p2 = getVertexPosition(m_F(2, index));
     Point3f pos = alpha * p0 + beta * p1 + (1 - alpha - beta) * p2;
-    // normal
-    if (m_N.size() != 0)
-    {
-        Vector3f n0 = m_N.col(m_F(0, index)), n1 = m_N.col(m_F(1, index)), n2 = m_N.col(m_F(2, index));
+
+    if (m_N.size() != 0) {
+        Vector3f n0 = getVertexNormal(m_F(0, index)), n1 = getVertexNormal(m_F(1, index)), n2 = getVertexNormal(m_F(2, index));
         normal = (alpha * n0 + beta * n1 + (1 - alpha - beta) * n2).normalized();
-    }
-    else
+    } else {
         normal = getSurfaceNormal(index);
-    pdf = 1 / m_surface;
+    }
     return pos;
 }
 
@@ -9,6 +9,7 @@
 #include <filesystem/resolver.h>
 #include <unordered_map>
 #include <fstream>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
@@ -23,10 +24,26 @@ public:
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        m_name = filename.str();
+
+        /* If this file was loaded before, share its geometry */
+        std::shared_ptr<MeshData> data;
+        {
+            std::lock_guard<std::mutex> lock(m_cacheMutex);
+            data = m_cache[m_name].lock();
+        }
+        if (data) {
+            setData(data, trafo);
+            computeBoundingBox();
+            cout << "Instancing \"" << filename << "\" (V=" << m_V.cols()
+                 << ", F=" << m_F.cols() << ")" << endl;
+            return;
+        }
+
         std::ifstream is(filename.str());
         if (is.fail())
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
-        Transform trafo = propList.getTransform("toWorld", Transform());
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
@@ -49,8 +66,6 @@ public:
             if (prefix == "v") {
                 Point3f p;
                 line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
                 positions.push_back(p);
             } else if (prefix == "vt") {
                 Point2f tc;
@@ -59,7 +74,7 @@ public:
             } else if (prefix == "vn") {
                 Normal3f n;
                 line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
+                normals.push_back(n.normalized());
             } else if (prefix == "f") {
                 std::string v1, v2, v3, v4;
                 line >> v1 >> v2 >> v3 >> v4;
@@ -92,26 +107,32 @@ public:
             }
         }
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        /* Geometry is stored in object space, so that other meshes
+           loading the same file can share it as instances */
+        data = std::make_shared<MeshData>((uint32_t) vertices.size(),
+            (uint32_t) indices.size()/3, !normals.empty(), !texcoords.empty());
+        memcpy(data->F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        setData(data, trafo);
 
-        m_V.resize(3, vertices.size());
         for (uint32_t i=0; i<vertices.size(); ++i)
             m_V.col(i) = positions.at(vertices[i].p-1);
 
         if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
             for (uint32_t i=0; i<vertices.size(); ++i)
                 m_N.col(i) = normals.at(vertices[i].n-1);
         }
 
         if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
             for (uint32_t i=0; i<vertices.size(); ++i)
                 m_UV.col(i) = texcoords.at(vertices[i].uv-1);
         }
 
-        m_name = filename.str();
+        computeBoundingBox();
+        {
+            std::lock_guard<std::mutex> lock(m_cacheMutex);
+            m_cache[m_name] = data;
+        }
+
         cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
              << timer.elapsedString() << " and "
              << memString(m_F.size() * sizeof(uint32_t) +
@@ -119,7 +140,32 @@ public:
              << ")" << endl;
     }
 
+    void bakeTransform() {
+        if (!m_instance)
+            return;
+        {
+            /* The geometry may be transformed in place below, after which
+               it can no longer be handed out as object space data */
+            std::lock_guard<std::mutex> lock(m_cacheMutex);
+            auto it = m_cache.find(m_name);
+            if (it != m_cache.end() && it->second.lock() == m_data)
+                m_cache.erase(it);
+        }
+        Mesh::bakeTransform();
+    }
+
 protected:
+    /// Compute the world space bounding box of the mesh
+    void computeBoundingBox() {
+        m_bbox.reset();
+        for (uint32_t i=0; i<getVertexCount(); ++i)
+            m_bbox.expandBy(getVertexPosition(i));
+    }
+
+    /// Geometry of previously loaded files (by filename)
+    static std::unordered_map<std::string, std::weak_ptr<MeshData>> m_cache;
+    static std::mutex m_cacheMutex;
+
     /// Vertex indices used by the OBJ format
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
@@ -159,5 +205,8 @@ protected:
     };
 };
 
+std::unordered_map<std::string, std::weak_ptr<MeshData>> WavefrontOBJ::m_cache;
+std::mutex WavefrontOBJ::m_cacheMutex;
+
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
 NORI_NAMESPACE_END
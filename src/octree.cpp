@@ -173,7 +173,7 @@ bool OctreeNode::RayIntersect(Ray3f& ray, Intersection& its, bool shadowRay, uin
 				if (shadowRay)
 					return true;
 				ray.maxt = its.t = t;
-				its.uv = Point2f(u, v);
+				its.bary = Point2f(u, v);
 				its.mesh = m_mesh;
 				idx_ = idx;
 				foundIntersection = true;
@@ -7,33 +7,44 @@ NORI_NAMESPACE_BEGIN
 class MISIntegrator : public Integrator {
 public:
     MISIntegrator(const PropertyList& props) {
-        // nothing to do
+        // choose emitter triangles with the light hierarchy, or emitter meshes by power
+        m_lightBVH = props.getBoolean("lightBVH", true);
     }
 
     // sample emitter, also return the pdf by solid angle
     Color3f sampleEmitter(const Intersection its, const Scene* scene, Sampler* sampler, const Ray3f& ray, 
         float &p_light, float &p_brdf) const {
-        Mesh* emitterMesh = scene->getEmitters()[floor(sampler->next1D() * scene->getEmitters().size())];
-        float pdfEmitterChoose = 1.f / scene->getEmitters().size();
-
-        // sample on the emitter
-        Point3f sample(sampler->next1D(), sampler->next1D(), sampler->next1D());
+        const Mesh* emitterMesh;
+        Point3f samplePos;
         Vector3f nEmit;
+        // pdf of the sampled position by area, including the choice of the emitter
         float pdfEmitter;
-        uint32_t idxEmit = 0;
-        Point3f samplePos = emitterMesh->sampleUniformPts(sampler, nEmit, pdfEmitter, idxEmit);
-
-        // visibility
-        Ray3f shadowRay(its.p, samplePos - its.p, 1e-6, 1 - 1e-6);
-        Intersection itsShadow;
-        if (scene->rayIntersect(shadowRay, itsShadow))
-        {
-            // if not self occluded, then it's truly occluded
-            if (!(itsShadow.mesh == emitterMesh || (itsShadow.mesh == its.mesh
-                && itsShadow.primIdx == its.primIdx)))
+        if (m_lightBVH) {
+            // the hierarchy prefers triangles that contribute most to its.p
+            EmitterSample eRec;
+            if (!scene->getLightBVH().sample(its.p, its.shFrame.n, sampler->next1D(), sampler->next2D(), eRec))
                 return Color3f(0.f);
+            emitterMesh = eRec.mesh;
+            samplePos = eRec.p;
+            nEmit = eRec.n;
+            pdfEmitter = eRec.pdf;
+        } else {
+            // emitters are chosen in proportion to their power
+            float pdfEmitterChoose;
+            Mesh* mesh = scene->sampleEmitter(sampler->next1D(), pdfEmitterChoose);
+
+            // sample on the emitter
+            Point3f sample(sampler->next1D(), sampler->next1D(), sampler->next1D());
+            uint32_t idxEmit = 0;
+            samplePos = mesh->sampleUniformPts(sampler, nEmit, pdfEmitter, idxEmit);
+            pdfEmitter *= pdfEmitterChoose;
+            emitterMesh = mesh;
         }
 
+        // visibility, hits on the emitter itself or on the shading triangle don't count
+        if (!scene->visible(its.p, samplePos, emitterMesh, &its))
+            return Color3f(0.f);
+
         // radiance
         Vector3f dxy = samplePos - its.p;
         float distSquare = dxy.squaredNorm();
@@ -49,60 +60,75 @@ public:
         auto wo = its.shFrame.toLocal(-ray.d.normalized());
         Color3f refRadiance = its.mesh->getBSDF()->eval(BSDFQueryRecord(wi, wo, ESolidAngle)) *
             Gxy * emitterMesh->getEmitter()->sample();
-        p_light = (pdfEmitterChoose * pdfEmitter) * distSquare / cos2;
+        p_light = pdfEmitter * distSquare / cos2;
         p_brdf = its.mesh->getBSDF()->pdf(BSDFQueryRecord(wi, wo, ESolidAngle));
         return (refRadiance);
     }
 
+    // iterative path tracer, every bounce is traced once and its intersection is used both
+    // for the MIS weight of the emission it hits and for continuing the path
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
         Intersection its;
         if (scene->getEmitters().empty()) return Color3f(0.f);
         if (!scene->rayIntersect(ray, its))
             return Color3f(0.f);
-        if (its.mesh->isEmitter() && its.shFrame.n.dot(-ray.d) > 0)
-            return its.mesh->getEmitter()->sample();
 
-
-        // hit something, start iterate
+        Color3f L(0.f), throughput(1.f);
         Ray3f itRay = ray;
-        // RR
-        if (sampler->next1D() > 1 - m_endP)
-            return Color3f(0.f);
-        // L_light = L_light * p_light / (p_light + p_brdf)
-        float p_light = 0, p_brdf = 0;
-        Color3f L_light = sampleEmitter(its, scene, sampler, ray, p_light, p_brdf);
-        L_light = L_light / (p_light + p_brdf);
-        if (isnan(L_light[0]) || isnan(L_light[1]) || isnan(L_light[2]))
-        {
-            L_light = Color3f(0.f);
-        }
-            
-
-        // BRDF sampling
-        BSDFQueryRecord rec(its.shFrame.toLocal(-ray.d.normalized()));
-        Color3f weight = (its.mesh->getBSDF()->sample(rec, sampler->next2D()));
-        itRay = Ray3f(its.p, its.shFrame.toWorld(rec.wo));
-        Color3f L_BRDF = Li(scene, sampler, itRay);
-        // itRay hit emitter, p_light != 0
-        p_light = 0;
-        p_brdf = its.mesh->getBSDF()->pdf(rec);
-        Intersection nextIts;
-        if (scene->rayIntersect(itRay, nextIts) && nextIts.mesh->isEmitter())
-        {
-            p_light = (1. / scene->getEmitters().size()) * (1. / nextIts.mesh->getAreaSum());
-            p_light *= (nextIts.p - its.p).squaredNorm();
-            p_light /= (its.p - nextIts.p).normalized().dot(nextIts.shFrame.n);
-        }
-        // only apply when its.mesh is diffuse, square is to dixiao the 1 / p_brdf in weight
-        if (its.mesh->getBSDF()->isDiffuse())
-            L_BRDF = L_BRDF * p_brdf / (p_light + p_brdf);
-        if (isnan(L_BRDF[0]) || isnan(L_BRDF[1]) || isnan(L_BRDF[2]))
-        {
-            //L_BRDF = Color3f(1.f, 0.f, 0.f);
-            L_BRDF = Color3f(0.f);
+        // MIS weight of emission found by the BSDF sample that led to its, 1 for camera rays
+        float emissionWeight = 1.f;
+
+        while (true) {
+            // the path ends at the first emitter it hits
+            if (its.mesh->isEmitter() && its.shFrame.n.dot(-itRay.d) > 0) {
+                L += throughput * its.mesh->getEmitter()->sample() * emissionWeight;
+                break;
+            }
+
+            // RR
+            if (sampler->next1D() > 1 - m_endP)
+                break;
+            throughput /= (1 - m_endP);
+
+            // L_light = L_light * p_light / (p_light + p_brdf)
+            float p_light = 0, p_brdf = 0;
+            Color3f L_light = sampleEmitter(its, scene, sampler, itRay, p_light, p_brdf);
+            L_light = L_light / (p_light + p_brdf);
+            if (!std::isnan(L_light[0]) && !std::isnan(L_light[1]) && !std::isnan(L_light[2]))
+                L += throughput * L_light;
+
+            // BRDF sampling
+            const BSDF* bsdf = its.mesh->getBSDF();
+            BSDFQueryRecord rec(its.shFrame.toLocal(-itRay.d.normalized()));
+            Color3f weight = bsdf->sample(rec, sampler->next2D());
+            if (weight.isZero())
+                break;
+            throughput *= weight;
+            p_brdf = bsdf->pdf(rec);
+            bool diffuse = bsdf->isDiffuse();
+
+            Point3f p = its.p;
+            Normal3f n = its.shFrame.n;
+            itRay = Ray3f(p, its.shFrame.toWorld(rec.wo));
+            if (!scene->rayIntersect(itRay, its))
+                break;
+
+            // itRay hit emitter, p_light != 0. only apply when the surface is diffuse,
+            // specular bounces can't be found by emitter sampling
+            emissionWeight = 1.f;
+            if (diffuse && its.mesh->isEmitter() && its.shFrame.n.dot(-itRay.d) > 0) {
+                if (m_lightBVH)
+                    p_light = scene->getLightBVH().pdf(p, n, its.mesh, its.primIdx);
+                else
+                    p_light = scene->pdfEmitter(its.mesh) * (1.f / its.mesh->getAreaSum());
+                p_light *= (its.p - p).squaredNorm();
+                p_light /= (p - its.p).normalized().dot(its.shFrame.n);
+                emissionWeight = p_brdf / (p_light + p_brdf);
+                if (std::isnan(emissionWeight))
+                    emissionWeight = 0.f;
+            }
         }
-        
-        return (L_light + weight * L_BRDF) / ((1 - m_endP));
+        return L;
     }
 
     std::string toString() const {
@@ -111,6 +137,7 @@ public:
 
 private:
     float m_endP = 0.05;
+    bool m_lightBVH;
 
 };
 NORI_REGISTER_CLASS(MISIntegrator, "path_mis");
@@ -14,7 +14,6 @@
 NORI_NAMESPACE_BEGIN
 
 Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
 }
 
 Scene::~Scene() {
@@ -24,9 +23,75 @@ Scene::~Scene() {
     delete m_integrator;
 }
 
+Camera *Scene::setCamera(Camera *camera) {
+    if (!camera)
+        throw NoriException("Scene::setCamera(): a camera is required!");
+    std::swap(camera, m_camera);
+    return camera;
+}
+
+Sampler *Scene::setSampler(Sampler *sampler) {
+    if (!sampler)
+        throw NoriException("Scene::setSampler(): a sampler is required!");
+    std::swap(sampler, m_sampler);
+    return sampler;
+}
+
+Mesh *Scene::sampleEmitter(float sample, float &pdf) const {
+    if (m_emitters.empty()) {
+        pdf = 0.f;
+        return nullptr;
+    }
+    size_t index = m_emitterPDF.sample(sample, pdf);
+    return m_sampledEmitters[index];
+}
+
+float Scene::pdfEmitter(const Mesh *emitter) const {
+    auto it = m_emitterIndex.find(emitter);
+    return it == m_emitterIndex.end() ? 0.f : m_emitterPDF[it->second];
+}
+
 void Scene::activate() {
+    if (!m_accel) {
+        /* Create a default (Embree) acceleration data structure */
+        m_accel = static_cast<Accel*>(
+            NoriObjectFactory::createInstance("embree", PropertyList()));
+    }
+    for (auto mesh : m_meshes) {
+        /* Meshes whose geometry is not shared with another mesh don't
+           benefit from instancing, so transform them into world space */
+        if (mesh->isInstance() && mesh->getData().use_count() == 1)
+            mesh->bakeTransform();
+        m_accel->addMesh(mesh);
+    }
     m_accel->build();
 
+    /* Choose emitters in proportion to their power. Emitters without
+       any radiance are left out of the distribution, since DiscretePDF
+       may still return an entry of zero weight (e.g. for a sample of 0) */
+    m_emitterPDF.clear();
+    m_emitterPDF.reserve(m_emitters.size());
+    m_sampledEmitters.clear();
+    m_emitterIndex.clear();
+    for (Mesh *emitter : m_emitters) {
+        float power = emitter->getEmitter()->sample().getLuminance() * emitter->getAreaSum();
+        if (!(power > 0))
+            continue;
+        m_emitterIndex[emitter] = m_sampledEmitters.size();
+        m_sampledEmitters.push_back(emitter);
+        m_emitterPDF.append(power);
+    }
+    if (m_sampledEmitters.empty() && !m_emitters.empty()) {
+        /* Fall back to uniform selection */
+        for (Mesh *emitter : m_emitters) {
+            m_emitterIndex[emitter] = m_sampledEmitters.size();
+            m_sampledEmitters.push_back(emitter);
+            m_emitterPDF.append(1.f);
+        }
+    }
+    m_emitterPDF.normalize();
+    m_lightBVH.build(m_emitters);
+
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
     if (!m_camera)
@@ -47,7 +112,6 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
                 if (mesh->isEmitter())
                     m_emitters.push_back(mesh);
@@ -61,6 +125,12 @@ void Scene::addChild(NoriObject *obj) {
             }
             break;
 
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one acceleration data structure per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         case ESampler:
             if (m_sampler)
                 throw NoriException("There can only be one sampler per scene!");
@@ -99,12 +169,14 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
+        indent(m_accel->toString()),
         indent(meshes, 2)
     );
 }
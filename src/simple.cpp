@@ -12,7 +12,7 @@ public:
 
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
         /* Find the surface that is visible in the requested direction */
-        Intersection its, itsTmp;
+        Intersection its;
         if (!scene->rayIntersect(ray, its))
             return Color3f(0.0f);
 
@@ -22,7 +22,7 @@ public:
         Vector3f dNorm = d;
         dNorm.normalize();
         Ray3f shadowRay(pos, d, 0.001, 0.999);
-        if (scene->rayIntersect(shadowRay, itsTmp))
+        if (scene->rayIntersect(shadowRay))
             return Color3f(0.0f);
         float cosTheta = its.geoFrame.cosTheta(its.geoFrame.toLocal(dNorm));
         return m_color * clamp(cosTheta, 0., 1.) / (4 * M_PI * M_PI * d.squaredNorm());
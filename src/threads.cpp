@@ -0,0 +1,184 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/threads.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+#include <fstream>
+#include <mutex>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Should the current (non-worker) thread be pinned while it is in the arena?
+static thread_local bool s_pinCaller = false;
+
+/**
+ * \brief Restricts the threads that join the arena to a set of cores
+ *
+ * Either every thread may use all given cores (NUMA partitioning), or
+ * each thread is pinned to one of them based on its slot in the arena.
+ * Threads that enter the arena through \ref runInThreadPool() are only
+ * pinned if requested, while the NUMA restriction applies to all threads.
+ * The previous affinity is restored when a thread leaves the arena, so
+ * that e.g. the main thread isn't left pinned to the core of slot 0
+ * after loading the scene.
+ */
+class PinningObserver : public tbb::task_scheduler_observer {
+public:
+    PinningObserver(tbb::task_arena &arena, const std::vector<int> &cores, bool pinThreads)
+        : tbb::task_scheduler_observer(arena), m_cores(cores), m_pinThreads(pinThreads) {
+        observe(true);
+    }
+
+    ~PinningObserver() { observe(false); }
+
+    void on_scheduler_entry(bool isWorker) {
+#if defined(__linux__)
+        if (m_pinThreads && !isWorker && !s_pinCaller)
+            return;
+        SavedAffinity &saved = savedAffinity();
+        if (!saved.valid)
+            saved.valid = pthread_getaffinity_np(pthread_self(), sizeof(saved.set), &saved.set) == 0;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (m_pinThreads) {
+            int slot = tbb::this_task_arena::current_thread_index();
+            CPU_SET(m_cores[(size_t) slot % m_cores.size()], &set);
+        } else {
+            for (int core : m_cores)
+                CPU_SET(core, &set);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    void on_scheduler_exit(bool /* isWorker */) {
+#if defined(__linux__)
+        SavedAffinity &saved = savedAffinity();
+        if (saved.valid) {
+            pthread_setaffinity_np(pthread_self(), sizeof(saved.set), &saved.set);
+            saved.valid = false;
+        }
+#endif
+    }
+
+private:
+#if defined(__linux__)
+    /// Affinity of the current thread before it entered the arena
+    struct SavedAffinity {
+        cpu_set_t set;
+        bool valid = false;
+    };
+
+    static SavedAffinity &savedAffinity() {
+        static thread_local SavedAffinity saved;
+        return saved;
+    }
+#endif
+
+    std::vector<int> m_cores;
+    bool m_pinThreads;
+};
+
+static std::mutex s_poolMutex;
+static tbb::task_arena *s_arena = nullptr;
+static PinningObserver *s_observer = nullptr;
+static int s_threadCount = 0;
+
+#if defined(__linux__)
+/// Return the cores that this process may run on
+static std::vector<int> getAllowedCores() {
+    std::vector<int> cores;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            if (CPU_ISSET(i, &set))
+                cores.push_back(i);
+    }
+    return cores;
+}
+
+/// Parse the core list of a NUMA node (e.g. "0-15,32-47")
+static std::vector<int> getNumaCores(int node) {
+    std::string filename = tfm::format("/sys/devices/system/node/node%i/cpulist", node);
+    std::ifstream is(filename);
+    std::string list;
+    if (!std::getline(is, list))
+        throw NoriException("NUMA node %i doesn't exist (unable to read \"%s\")!", node, filename);
+
+    std::vector<int> cores;
+    for (const std::string &range : tokenize(list, ",")) {
+        std::vector<std::string> bounds = tokenize(range, "-");
+        int first = toInt(bounds[0]), last = bounds.size() > 1 ? toInt(bounds[1]) : first;
+        for (int i = first; i <= last; ++i)
+            cores.push_back(i);
+    }
+    return cores;
+}
+#endif
+
+/// Create the arena (must be called with 's_poolMutex' held)
+static void createPool(int threadCount, bool pinThreads, int numaNode) {
+    std::vector<int> cores;
+#if defined(__linux__)
+    if (numaNode >= 0)
+        cores = getNumaCores(numaNode);
+    else if (pinThreads)
+        cores = getAllowedCores();
+#else
+    if (pinThreads || numaNode >= 0)
+        throw NoriException("Thread pinning and NUMA partitioning are only supported on Linux!");
+#endif
+
+    if (threadCount <= 0)
+        threadCount = cores.empty() ? getCoreCount() : (int) cores.size();
+
+    s_arena = new tbb::task_arena(threadCount);
+    s_arena->initialize();
+    if (!cores.empty())
+        s_observer = new PinningObserver(*s_arena, cores, pinThreads);
+    s_threadCount = threadCount;
+}
+
+void initThreadPool(int threadCount, bool pinThreads, int numaNode) {
+    std::lock_guard<std::mutex> lock(s_poolMutex);
+    if (s_arena)
+        throw NoriException("initThreadPool(): the thread pool already exists!");
+    createPool(threadCount, pinThreads, numaNode);
+}
+
+int getThreadCount() {
+    std::lock_guard<std::mutex> lock(s_poolMutex);
+    if (!s_arena)
+        createPool(-1, false, -1);
+    return s_threadCount;
+}
+
+void runInThreadPool(const std::function<void()> &func, bool pinCaller) {
+    {
+        std::lock_guard<std::mutex> lock(s_poolMutex);
+        if (!s_arena)
+            createPool(-1, false, -1);
+    }
+    bool prevPinCaller = s_pinCaller;
+    s_pinCaller = pinCaller;
+    try {
+        s_arena->execute(func);
+    } catch (...) {
+        s_pinCaller = prevPinCaller;
+        throw;
+    }
+    s_pinCaller = prevPinCaller;
+}
+
+NORI_NAMESPACE_END
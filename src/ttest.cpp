@@ -9,7 +9,9 @@
 #include <nori/camera.h>
 #include <nori/integrator.h>
 #include <nori/sampler.h>
+#include <nori/block.h>
 #include <hypothesis.h>
+#include <tbb/parallel_for.h>
 #include <pcg32.h>
 
 /*
@@ -151,23 +153,53 @@ public:
 
                 cout << "Generating " << m_sampleCount << " paths.. " << endl;
 
+                /* The paths are generated in a fixed number of chunks, which run
+                   in parallel. Each chunk uses its own sample stream, so that the
+                   result does not depend on the number of threads */
+                const int chunkCount = 64;
+                std::vector<double> chunkMean(chunkCount, 0.0), chunkM2(chunkCount, 0.0);
+                std::vector<int> chunkSize(chunkCount);
+                tbb::parallel_for(0, chunkCount, [&](int chunk) {
+                    std::unique_ptr<Sampler> chunkSampler(sampler->clone());
+                    chunkSampler->setStream((uint32_t) chunk);
+                    chunkSampler->prepare(ImageBlock(Vector2i(1), nullptr));
+
+                    int count = m_sampleCount / chunkCount + (chunk < m_sampleCount % chunkCount ? 1 : 0);
+                    double mean = 0, m2 = 0;
+                    for (int k=0; k<count; ++k) {
+                        /* Sample a ray from the camera */
+                        Ray3f ray;
+                        Point2f pixelSample = (chunkSampler->next2D().array()
+                            * camera->getOutputSize().cast<float>().array()).matrix();
+                        Color3f value = camera->sampleRay(ray, pixelSample, chunkSampler->next2D());
+
+                        /* Compute the incident radiance */
+                        value *= integrator->Li(scene, chunkSampler.get(), ray);
+
+                        /* Numerically robust online variance estimation using an
+                           algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
+                        double result = (double) value.getLuminance();
+                        double delta = result - mean;
+                        mean += delta / (double) (k+1);
+                        m2 += delta * (result - mean);
+                    }
+                    chunkSize[chunk] = count;
+                    chunkMean[chunk] = mean;
+                    chunkM2[chunk] = m2;
+                });
+
+                /* Combine the chunks (in a fixed order) using the pairwise
+                   update by Chan et al. */
                 double mean = 0, variance = 0;
-                for (int k=0; k<m_sampleCount; ++k) {
-                    /* Sample a ray from the camera */
-                    Ray3f ray;
-                    Point2f pixelSample = (sampler->next2D().array()
-                        * camera->getOutputSize().cast<float>().array()).matrix();
-                    Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
-
-                    /* Compute the incident radiance */
-                    value *= integrator->Li(scene, sampler, ray);
-
-                    /* Numerically robust online variance estimation using an
-                       algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
-                    double result = (double) value.getLuminance();
-                    double delta = result - mean;
-                    mean += delta / (double) (k+1);
-                    variance += delta * (result - mean);
+                int n = 0;
+                for (int chunk=0; chunk<chunkCount; ++chunk) {
+                    int nb = chunkSize[chunk];
+                    if (nb == 0)
+                        continue;
+                    double delta = chunkMean[chunk] - mean;
+                    mean += delta * nb / (double) (n + nb);
+                    variance += chunkM2[chunk] + delta * delta * n * nb / (double) (n + nb);
+                    n += nb;
                 }
                 variance /= m_sampleCount - 1;
 
@@ -0,0 +1,266 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/sampler.h>
+#include <nori/block.h>
+#include <nori/bsdf.h>
+#include <nori/emitter.h>
+#include <numeric>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Wavefront path tracer
+ *
+ * Instead of following one path at a time through recursive calls, this
+ * integrator keeps a large set of paths in flight and advances all of them
+ * by one bounce per iteration. Each iteration runs in stages:
+ *
+ * 1. extension: the rays of all paths are traced as one batch
+ * 2. emission: paths that hit an emitter receive its (MIS-weighted) radiance
+ * 3. shading: the hits are grouped by BSDF, and each path samples an emitter
+ *    (queueing a shadow ray) and its BSDF (producing the next ray)
+ * 4. shadow rays: all occlusion tests are traced as one batch, and the
+ *    unoccluded emitter samples are accumulated
+ *
+ * The paths are stored as a structure of arrays, so that every stage walks
+ * over contiguous memory. Emitter sampling and BSDF sampling are combined
+ * using the balance heuristic.
+ *
+ * The following properties are supported:
+ *
+ * - \c maxDepth: maximum number of bounces (default: 16)
+ * - \c rrDepth: depth at which Russian roulette starts (default: 3)
+ * - \c maxPaths: maximum number of paths in flight per thread (default: 16384)
+ */
+class WavefrontIntegrator : public Integrator {
+public:
+    WavefrontIntegrator(const PropertyList &props) {
+        m_maxDepth = props.getInteger("maxDepth", 16);
+        m_rrDepth = props.getInteger("rrDepth", 3);
+        m_maxPaths = props.getInteger("maxPaths", 16384);
+        if (m_maxDepth < 1 || m_rrDepth < 0 || m_maxPaths < 1)
+            throw NoriException("WavefrontIntegrator: invalid depth or path count!");
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        /* Single samples are computed as a wavefront of one path */
+        PathStates paths;
+        paths.add(Point2f(0.f), ray, Color3f(1.f));
+        trace(scene, sampler, paths);
+        return paths.radiance[0];
+    }
+
+    bool renderPixels(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                      const std::vector<Point2i> &pixels, uint32_t sampleCount) const {
+        const Camera *camera = scene->getCamera();
+        size_t pathCount = pixels.size() * sampleCount;
+        PathStates paths;
+
+        for (size_t start = 0; start < pathCount; start += (size_t) m_maxPaths) {
+            size_t end = std::min(pathCount, start + (size_t) m_maxPaths);
+
+            /* Stage 0: generate the camera rays */
+            paths.clear();
+            for (size_t i = start; i < end; ++i) {
+                Point2f pixelSample = pixels[i / sampleCount].cast<float>() + sampler->next2D();
+                Point2f apertureSample = sampler->next2D();
+                Ray3f ray;
+                Color3f weight = camera->sampleRay(ray, pixelSample, apertureSample);
+                paths.add(pixelSample, ray, weight);
+            }
+            paths.rays.coherent = true;
+
+            trace(scene, sampler, paths);
+
+            for (size_t i = 0; i < paths.size(); ++i)
+                block.put(paths.pixel[i], paths.radiance[i]);
+        }
+        return true;
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "WavefrontIntegrator[\n"
+            "  maxDepth = %i,\n"
+            "  rrDepth = %i,\n"
+            "  maxPaths = %i\n"
+            "]",
+            m_maxDepth,
+            m_rrDepth,
+            m_maxPaths
+        );
+    }
+
+private:
+    /// State of all paths in flight (structure of arrays)
+    struct PathStates {
+        std::vector<Point2f> pixel;        ///< Position on the image plane
+        std::vector<Color3f> throughput;   ///< Product of the sampling weights so far
+        std::vector<Color3f> radiance;     ///< Radiance collected so far
+        std::vector<Point3f> origin;       ///< Vertex that the current ray starts from
+        std::vector<float> bsdfPdf;        ///< Solid angle density of the last BSDF sample
+        std::vector<uint8_t> specular;     ///< Camera ray or discrete BSDF sample?
+
+        std::vector<uint32_t> active;      ///< Paths that are still alive
+        RayBatch rays;                     ///< Current ray of each active path
+
+        void clear() {
+            pixel.clear(); throughput.clear(); radiance.clear();
+            origin.clear(); bsdfPdf.clear(); specular.clear();
+            active.clear(); rays.clear();
+        }
+
+        void add(const Point2f &p, const Ray3f &ray, const Color3f &weight) {
+            active.push_back((uint32_t) pixel.size());
+            rays.add(ray);
+            pixel.push_back(p);
+            throughput.push_back(weight);
+            radiance.push_back(Color3f(0.f));
+            origin.push_back(ray.o);
+            bsdfPdf.push_back(0.f);
+            specular.push_back(1);
+        }
+
+        size_t size() const { return pixel.size(); }
+    };
+
+    /// Shadow rays of the current bounce (structure of arrays)
+    struct ShadowQueue {
+        RayBatch rays;
+        std::vector<uint32_t> path;        ///< Path that receives the contribution
+        std::vector<Color3f> contribution; ///< Radiance if the ray is unoccluded
+
+        void clear() { rays.clear(); path.clear(); contribution.clear(); }
+    };
+
+    /// Advance all active paths until they have terminated
+    void trace(const Scene *scene, Sampler *sampler, PathStates &paths) const {
+        bool hasEmitters = !scene->getEmitters().empty();
+
+        HitBatch hits, shadowHits;
+        ShadowQueue shadow;
+        std::vector<uint32_t> shade;
+        std::vector<uint32_t> nextActive;
+        RayBatch nextRays;
+
+        for (int depth = 0; !paths.active.empty(); ++depth) {
+            /* Stage 1: find the next vertex of all paths */
+            scene->rayIntersect(paths.rays, hits);
+
+            /* Stage 2: emission and termination */
+            shade.clear();
+            for (uint32_t k = 0; k < (uint32_t) paths.active.size(); ++k) {
+                if (!hits.hit[k])
+                    continue;
+                uint32_t idx = paths.active[k];
+                const Intersection &its = hits.its[k];
+                const Ray3f &ray = paths.rays.rays[k];
+
+                if (its.mesh->isEmitter() && its.shFrame.n.dot(-ray.d) > 0) {
+                    float weight = 1.f;
+                    if (!paths.specular[idx]) {
+                        /* Balance heuristic against emitter sampling */
+                        Vector3f d = its.p - paths.origin[idx];
+                        float cosTheta = its.shFrame.n.dot(-d.normalized());
+                        float lightPdf = scene->pdfEmitter(its.mesh) / its.mesh->getAreaSum() *
+                            d.squaredNorm() / cosTheta;
+                        weight = paths.bsdfPdf[idx] / (paths.bsdfPdf[idx] + lightPdf);
+                    }
+                    paths.radiance[idx] += paths.throughput[idx] * its.mesh->getEmitter()->sample() * weight;
+                }
+
+                if (depth + 1 >= m_maxDepth)
+                    continue;
+
+                /* Russian roulette based on the path throughput */
+                if (depth >= m_rrDepth) {
+                    float q = std::min(paths.throughput[idx].maxCoeff(), 0.95f);
+                    if (sampler->next1D() >= q)
+                        continue;
+                    paths.throughput[idx] /= q;
+                }
+                shade.push_back(k);
+            }
+
+            /* Group the hits by BSDF, so that each one is evaluated in one go */
+            std::stable_sort(shade.begin(), shade.end(), [&](uint32_t a, uint32_t b) {
+                return hits.its[a].mesh->getBSDF() < hits.its[b].mesh->getBSDF();
+            });
+
+            /* Stage 3: sample an emitter and the BSDF at each vertex */
+            shadow.clear();
+            nextActive.clear();
+            nextRays.clear();
+            for (uint32_t k : shade) {
+                uint32_t idx = paths.active[k];
+                const Intersection &its = hits.its[k];
+                const BSDF *bsdf = its.mesh->getBSDF();
+                Vector3f wi = its.shFrame.toLocal(-paths.rays.rays[k].d.normalized());
+
+                if (hasEmitters) {
+                    float emitterPdf;
+                    Mesh *emitter = scene->sampleEmitter(sampler->next1D(), emitterPdf);
+                    Vector3f nEmitter;
+                    float areaPdf;
+                    Point3f q = emitter->sampleUniformPts(sampler, nEmitter, areaPdf, 0);
+
+                    Vector3f d = q - its.p;
+                    float distSquared = d.squaredNorm();
+                    Vector3f dir = d / std::sqrt(distSquared);
+                    float cosSurface = its.shFrame.n.dot(dir), cosEmitter = nEmitter.dot(-dir);
+
+                    if (cosSurface > 0 && cosEmitter > 0) {
+                        BSDFQueryRecord bRec(wi, its.shFrame.toLocal(dir), ESolidAngle);
+                        Color3f f = bsdf->eval(bRec);
+                        if (!f.isZero()) {
+                            float lightPdf = emitterPdf * areaPdf * distSquared / cosEmitter;
+                            float weight = lightPdf / (lightPdf + bsdf->pdf(bRec));
+                            shadow.rays.add(Ray3f(its.p, d, Epsilon, 1 - Epsilon));
+                            shadow.path.push_back(idx);
+                            shadow.contribution.push_back(paths.throughput[idx] * f * cosSurface *
+                                emitter->getEmitter()->sample() * (weight / lightPdf));
+                        }
+                    }
+                }
+
+                BSDFQueryRecord bRec(wi);
+                Color3f weight = bsdf->sample(bRec, sampler->next2D());
+                if (weight.isZero())
+                    continue;
+
+                paths.throughput[idx] *= weight;
+                paths.specular[idx] = bRec.measure == EDiscrete;
+                paths.bsdfPdf[idx] = paths.specular[idx] ? 0.f : bsdf->pdf(bRec);
+                paths.origin[idx] = its.p;
+                nextActive.push_back(idx);
+                nextRays.add(Ray3f(its.p, its.shFrame.toWorld(bRec.wo)));
+            }
+
+            /* Stage 4: accumulate the unoccluded emitter samples */
+            if (shadow.rays.size() > 0) {
+                scene->rayOccluded(shadow.rays, shadowHits);
+                for (size_t j = 0; j < shadow.rays.size(); ++j)
+                    if (!shadowHits.hit[j])
+                        paths.radiance[shadow.path[j]] += shadow.contribution[j];
+            }
+
+            paths.active.swap(nextActive);
+            paths.rays.rays.swap(nextRays.rays);
+            paths.rays.coherent = false;
+        }
+    }
+
+    int m_maxDepth;
+    int m_rrDepth;
+    int m_maxPaths;
+};
+
+NORI_REGISTER_CLASS(WavefrontIntegrator, "wavefront");
+NORI_NAMESPACE_END
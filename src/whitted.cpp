@@ -25,8 +25,9 @@ public:
         // diffuse material
         if (its.mesh->getBSDF()->isDiffuse())
         {
-            Mesh* emitterMesh = scene->getEmitters()[floor(sampler->next1D() * scene->getEmitters().size())];
-            float pdfEmitterChoose = 1.f / scene->getEmitters().size();
+            // emitters are chosen in proportion to their power
+            float pdfEmitterChoose;
+            Mesh* emitterMesh = scene->sampleEmitter(sampler->next1D(), pdfEmitterChoose);
 
             // sample on the emitter
             Point3f sample(sampler->next1D(), sampler->next1D(), sampler->next1D());
@@ -35,16 +36,9 @@ public:
             uint32_t idxEmit = 0;
             Point3f samplePos = emitterMesh->sampleUniformPts(sampler, nEmit, pdfEmitter, idxEmit);
 
-            // visibility
-            Ray3f shadowRay(its.p, samplePos - its.p, 1e-6, 1 - 1e-6);
-            Intersection itsShadow;
-            if (scene->rayIntersect(shadowRay, itsShadow))
-            {
-                // if not self occluded
-                if (!(itsShadow.mesh == emitterMesh || (itsShadow.mesh == its.mesh
-                    && itsShadow.primIdx == its.primIdx)))
-                    return emitRadiance;
-            }
+            // visibility, hits on the emitter itself or on the shading triangle don't count
+            if (!scene->visible(its.p, samplePos, emitterMesh, &its))
+                return emitRadiance;
 
             // radiance
             Vector3f dxy = samplePos - its.p;